@@ -27,6 +27,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#if !defined(_WIN32)
+#define ULZ77C_POSIX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+#if !defined(_WIN32) && !defined(ULZ77_NO_THREADS)
+#define ULZ77C_THREADS
+#include <pthread.h>
+#endif
+/* io_uring needs the thread of stage, ULZ77C_URING is set by Makefile
+ * when liburing is found */
+#if defined(ULZ77C_URING) && defined(ULZ77C_THREADS)
+#include <liburing.h>
+#else
+#undef ULZ77C_URING
+#endif
 #include "argsparse.h"
 #include "ulz77.h"
 
@@ -50,7 +69,20 @@ int show_help(void)
         "    [stream|file]\n"
         "  -c         <sourcefile>   Input file\n"
         "  -o         <destfile>     Output file\n"
-        "  -bs        <blocksize>    Specify block size of stream\n"
+        "  -bs        <blocksize>    Block size of stream [1-1G], default 1M\n"
+        "  -T         <threads>      Threads (de)compressing blocks of stream, default 1\n"
+        "  --seekable                Write index of blocks at the end of stream\n"
+        "  --linked                  Blocks of stream refer to the previous ones\n"
+        "  --mmap                    Map files into memory (file method)\n"
+        "  --io       <backend>      File I/O of stream method [stdio|pread|uring],\n"
+        "                            default stdio\n"
+        "  --level    <level>        Compression level [0-10|max], default 6\n"
+        "  --window   <size>         Window size [4K-16M], power of 2, default 64K\n"
+        "  --sequence                Literal runs and matches in sequences\n"
+        "  --entropy                 Huffman coded sequences\n"
+        "  -D         <dictfile>     Preset dictionary, same for decompression\n"
+        "  --train    <samples...>   Train dictionary from samples into output file\n"
+        "  --maxdict  <size>         Size limit of trained dictionary, default 32K\n"
         "\n"
         "  --help                    Show help info\n"
         "  --version                 Show version info\n";
@@ -62,6 +94,7 @@ int show_help(void)
 
 #define ULZ77C_MODE_COMPRESSION 0
 #define ULZ77C_MODE_DECOMPRESSION 1
+#define ULZ77C_MODE_TRAIN 2
 #define ULZ77C_METHOD_STREAM 0
 #define ULZ77C_METHOD_FILE 1
 
@@ -69,6 +102,27 @@ int show_help(void)
 #define BUFFER_SIZE 4096
 #endif
 
+#ifndef FEED_BUFFER_SIZE
+#define FEED_BUFFER_SIZE (64 * 1024)
+#endif
+
+/* Buffers of a pipe stage, one being read or written by the thread of
+ * stage while the others are processed */
+#ifndef PIPE_DEPTH
+#define PIPE_DEPTH 4
+#endif
+#ifndef PIPE_WRITE_SIZE
+#define PIPE_WRITE_SIZE (256 * 1024)
+#endif
+
+/* File I/O of pipe stages */
+enum
+{
+    PIPE_IO_STDIO = 0, /* fread() and fwrite(), any file */
+    PIPE_IO_PREAD = 1, /* pread() and pwrite() at offsets, regular files */
+    PIPE_IO_URING = 2, /* io_uring with every buffer in flight, regular files */
+};
+
 #ifndef MAX
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #endif
@@ -76,14 +130,826 @@ int show_help(void)
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
 
-int ulz77_stream_compress(char *filename_dst, char *filename_src, size_t bs)
+/* Parse size like 4096, 64K, 16M or 1G, return 0 if it is invalid */
+size_t parse_size(const char *str)
+{
+    char *endp;
+    unsigned long size;
+
+    size = strtoul(str, &endp, 10);
+    if ((*endp == 'K') || (*endp == 'k')) { size <<= 10; endp++; }
+    else if ((*endp == 'M') || (*endp == 'm')) { size <<= 20; endp++; }
+    else if ((*endp == 'G') || (*endp == 'g')) { size <<= 30; endp++; }
+    if ((*endp != '\0') || (endp == str)) return 0;
+
+    return (size_t)size;
+}
+
+/* Parse window size like 4096, 64K or 16M into window log, 
+ * return 0 if the size is not a supported power of 2 */
+unsigned int parse_window_log(const char *str)
+{
+    size_t size = parse_size(str);
+    unsigned int window_log;
+
+    for (window_log = ULZ77_WINDOW_LOG_MIN; window_log <= ULZ77_WINDOW_LOG_MAX; window_log++)
+    {
+        if (size == (1UL << window_log)) return window_log;
+    }
+    return 0;
+}
+
+/* Append the content of file to buffer of len bytes, return 0 if succeed */
+int append_file(const char *filename, unsigned char **buffer, size_t *len)
+{
+    FILE *fp = NULL;
+    unsigned char *new_buffer;
+    long file_len;
+    int ret = -1;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) goto fail;
+    if (fseek(fp, 0, SEEK_END) != 0) goto fail;
+    if ((file_len = ftell(fp)) < 0) goto fail;
+    if (fseek(fp, 0, SEEK_SET) != 0) goto fail;
+
+    new_buffer = (unsigned char *)realloc(*buffer, sizeof(unsigned char) * (*len + (size_t)file_len + 1));
+    if (new_buffer == NULL) goto fail;
+    *buffer = new_buffer;
+    if ((file_len != 0) && (fread(*buffer + *len, (size_t)file_len, 1, fp) < 1)) goto fail;
+    *len += (size_t)file_len;
+
+    ret = 0;
+fail:
+    if (fp != NULL) fclose(fp);
+    return ret;
+}
+
+/* Load preset dictionary from file, return NULL if failed */
+struct ulz77_dict *load_dict(const char *filename)
+{
+    unsigned char *buffer = NULL;
+    size_t len = 0;
+    struct ulz77_dict *dict = NULL;
+
+    if (append_file(filename, &buffer, &len) == 0)
+        dict = ulz77_dict_create(buffer, len);
+    if (buffer != NULL) free(buffer);
+    return dict;
+}
+
+/* Compressed size of samples, each compressed alone */
+int compressed_size(size_t *total, unsigned char *samples, const size_t *sample_sizes, int sample_count, const struct ulz77_params *params)
+{
+    unsigned char *dst = NULL;
+    size_t dst_cap = 0, dst_len, offset = 0;
+    int ret = 0, i;
+
+    *total = 0;
+    for (i = 0; i < sample_count; i++)
+    {
+        if (ulz77_compress_bound(sample_sizes[i]) > dst_cap)
+        {
+            if (dst != NULL) free(dst);
+            dst_cap = ulz77_compress_bound(sample_sizes[i]);
+            dst = (unsigned char *)malloc(sizeof(unsigned char) * dst_cap);
+            if (dst == NULL) return -ULZ77_ERR_MALLOC;
+        }
+        ret = ulz77_compress_into(dst, dst_cap, &dst_len, samples + offset, sample_sizes[i], params);
+        if (ret != 0) break;
+        *total += dst_len;
+        offset += sample_sizes[i];
+    }
+    if (dst != NULL) free(dst);
+    return ret;
+}
+
+/* Train dictionary from sample files, every 10th sample is held out to
+ * show the ratio with the dictionary on data it has not seen */
+int ulz77_train(char *filename_dst, char **filename_samples, int sample_count, size_t dict_size, const struct ulz77_params *params)
+{
+    int ret = 0;
+    unsigned char *samples = NULL, *holdout = NULL, *dict_buf = NULL;
+    size_t *sample_sizes = NULL, *holdout_sizes = NULL;
+    size_t samples_len = 0, holdout_len = 0, len, dict_len, plain_size, dict_comp_size;
+    int train_count = 0, holdout_count = 0, i;
+    struct ulz77_params dict_params;
+    struct ulz77_dict *dict = NULL;
+    FILE *fp_dst = NULL;
+
+    if (sample_count <= 0) return -ULZ77_ERR_INVALID_ARGS;
+
+    sample_sizes = (size_t *)malloc(sizeof(size_t) * (size_t)sample_count);
+    holdout_sizes = (size_t *)malloc(sizeof(size_t) * (size_t)sample_count);
+    dict_buf = (unsigned char *)malloc(sizeof(unsigned char) * dict_size);
+    if ((sample_sizes == NULL) || (holdout_sizes == NULL) || (dict_buf == NULL))
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto fail;
+    }
+
+    for (i = 0; i < sample_count; i++)
+    {
+        if ((sample_count >= 10) && (i % 10 == 9))
+        {
+            len = holdout_len;
+            if (append_file(filename_samples[i], &holdout, &holdout_len) != 0) { ret = -ULZ77_ERR_FILE_READ; goto fail; }
+            holdout_sizes[holdout_count++] = holdout_len - len;
+        }
+        else
+        {
+            len = samples_len;
+            if (append_file(filename_samples[i], &samples, &samples_len) != 0) { ret = -ULZ77_ERR_FILE_READ; goto fail; }
+            sample_sizes[train_count++] = samples_len - len;
+        }
+    }
+
+    dict_len = 0;
+    if ((train_count != 0) && \
+            ((ret = ulz77_dict_train(dict_buf, dict_size, &dict_len, samples, sample_sizes, (size_t)train_count)) != 0))
+    {
+        goto fail;
+    }
+
+    fp_dst = fopen(filename_dst, "wb+");
+    if (fp_dst == NULL)
+    {
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto fail;
+    }
+    if ((dict_len != 0) && (fwrite(dict_buf, dict_len, 1, fp_dst) < 1))
+    {
+        ret = -ULZ77_ERR_FILE_WRITE;
+        goto fail;
+    }
+    printf("Dictionary : %lu bytes from %d samples of %lu bytes\n", \
+            (unsigned long)dict_len, train_count, (unsigned long)samples_len);
+
+    if (holdout_count == 0)
+    {
+        printf("Holdout    : none, fewer than 10 samples\n");
+        goto done;
+    }
+    dict = ulz77_dict_create(dict_buf, dict_len);
+    if (dict == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto fail;
+    }
+    dict_params = *params;
+    dict_params.dict = dict;
+    if (((ret = compressed_size(&plain_size, holdout, holdout_sizes, holdout_count, params)) != 0) || \
+            ((ret = compressed_size(&dict_comp_size, holdout, holdout_sizes, holdout_count, &dict_params)) != 0))
+    {
+        goto fail;
+    }
+    printf("Holdout    : %d samples of %lu bytes\n", holdout_count, (unsigned long)holdout_len);
+    printf("  without dictionary : %lu bytes, ratio %.3f\n", \
+            (unsigned long)plain_size, (double)holdout_len / (double)MAX(plain_size, 1));
+    printf("  with dictionary    : %lu bytes, ratio %.3f\n", \
+            (unsigned long)dict_comp_size, (double)holdout_len / (double)MAX(dict_comp_size, 1));
+
+done:
+    ret = 0;
+fail:
+    if (fp_dst != NULL) fclose(fp_dst);
+    if (dict != NULL) ulz77_dict_destroy(dict);
+    if (samples != NULL) free(samples);
+    if (holdout != NULL) free(holdout);
+    if (sample_sizes != NULL) free(sample_sizes);
+    if (holdout_sizes != NULL) free(holdout_sizes);
+    if (dict_buf != NULL) free(dict_buf);
+    return ret;
+}
+
+/* Pipe stage, a thread reading the source or writing the destination
+ * while the main thread (de)compresses. Buffers go round between two
+ * rings, the ready ones (read, or to be written) and the empty ones.
+ * Without threads the stage reads and writes in place */
+struct pipe_buffer
+{
+    unsigned char *data;
+    size_t len;
+
+    /* transfer in flight of io_uring */
+    uint64_t offset;
+    size_t want;
+    size_t done;
+    uint64_t seq; /* buffers read are handed over in order */
+    int queued; /* submitted to the ring and not completed yet */
+    int completed;
+};
+
+struct pipe_ring
+{
+    struct pipe_buffer *slots[PIPE_DEPTH];
+    uint64_t head; /* counters only grow, a ring holds every buffer at most */
+    uint64_t tail;
+};
+
+struct pipe_stage
+{
+    FILE *fp;
+    int writing;
+    int io;
+    int fd;
+    uint64_t offset; /* of the next read or write at offsets */
+    uint64_t size; /* of the source read with io_uring */
+    size_t capacity; /* of each buffer */
+    int depth;
+    struct pipe_buffer buffers[PIPE_DEPTH];
+    struct pipe_buffer *current; /* being filled by the main thread (writing) */
+    int ret; /* the first error of stage */
+#ifdef ULZ77C_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    int closed;
+    struct pipe_ring ready;
+    struct pipe_ring empty;
+#endif
+#ifdef ULZ77C_URING
+    struct io_uring ring;
+    int registered; /* buffers are registered with the ring */
+#endif
+};
+
+/* Read a buffer of source, less than capacity only at the end */
+static int pipe_io_read(struct pipe_stage *stage, struct pipe_buffer *buf)
+{
+#ifdef ULZ77C_POSIX
+    ssize_t n;
+
+    if (stage->io != PIPE_IO_STDIO)
+    {
+        buf->len = 0;
+        while (buf->len < stage->capacity)
+        {
+            n = pread(stage->fd, buf->data + buf->len, stage->capacity - buf->len, (off_t)stage->offset);
+            if ((n < 0) && (errno == EINTR)) continue;
+            if (n < 0) return -ULZ77_ERR_FILE_READ;
+            if (n == 0) break;
+            buf->len += (size_t)n;
+            stage->offset += (uint64_t)n;
+        }
+        return 0;
+    }
+#endif
+    buf->len = fread(buf->data, 1, stage->capacity, stage->fp);
+    return ferror(stage->fp) ? -ULZ77_ERR_FILE_READ : 0;
+}
+
+/* Write a buffer into destination */
+static int pipe_io_write(struct pipe_stage *stage, const struct pipe_buffer *buf)
+{
+#ifdef ULZ77C_POSIX
+    ssize_t n;
+    size_t done;
+
+    if (stage->io != PIPE_IO_STDIO)
+    {
+        done = 0;
+        while (done < buf->len)
+        {
+            n = pwrite(stage->fd, buf->data + done, buf->len - done, (off_t)stage->offset);
+            if ((n < 0) && (errno == EINTR)) continue;
+            if (n <= 0) return -ULZ77_ERR_FILE_WRITE;
+            done += (size_t)n;
+            stage->offset += (uint64_t)n;
+        }
+        return 0;
+    }
+#endif
+    if ((buf->len != 0) && (fwrite(buf->data, buf->len, 1, stage->fp) < 1)) return -ULZ77_ERR_FILE_WRITE;
+    return 0;
+}
+
+#ifdef ULZ77C_THREADS
+
+static void pipe_ring_put(struct pipe_ring *ring, struct pipe_buffer *buf)
+{
+    ring->slots[ring->tail++ % PIPE_DEPTH] = buf;
+}
+
+/* Take a buffer from ring of stage locked, wait for one unless the stage
+ * is closed, return NULL if it is closed and the ring is empty */
+static struct pipe_buffer *pipe_ring_take(struct pipe_stage *stage, struct pipe_ring *ring)
+{
+    while ((ring->head == ring->tail) && (stage->closed == 0))
+        pthread_cond_wait(&stage->changed, &stage->lock);
+    if (ring->head == ring->tail) return NULL;
+    return ring->slots[ring->head++ % PIPE_DEPTH];
+}
+
+/* Read the source into empty buffers, a buffer of no data is the end */
+static void *pipe_reader(void *arg)
+{
+    struct pipe_stage *stage = (struct pipe_stage *)arg;
+    struct pipe_buffer *buf;
+    int failed;
+
+    pthread_mutex_lock(&stage->lock);
+    while ((stage->closed == 0) && ((buf = pipe_ring_take(stage, &stage->empty)) != NULL))
+    {
+        pthread_mutex_unlock(&stage->lock);
+        failed = pipe_io_read(stage, buf);
+        pthread_mutex_lock(&stage->lock);
+        if (failed != 0)
+        {
+            /* the main thread stops at the end and gets the error */
+            stage->ret = failed;
+            buf->len = 0;
+        }
+        pipe_ring_put(&stage->ready, buf);
+        pthread_cond_broadcast(&stage->changed);
+        if (buf->len == 0) break;
+    }
+    pthread_mutex_unlock(&stage->lock);
+    return NULL;
+}
+
+/* Write the ready buffers in order till the stage is closed, after an
+ * error they are only recycled */
+static void *pipe_writer(void *arg)
+{
+    struct pipe_stage *stage = (struct pipe_stage *)arg;
+    struct pipe_buffer *buf;
+    int failed;
+
+    pthread_mutex_lock(&stage->lock);
+    while ((buf = pipe_ring_take(stage, &stage->ready)) != NULL)
+    {
+        failed = stage->ret;
+        pthread_mutex_unlock(&stage->lock);
+        if (failed == 0) failed = pipe_io_write(stage, buf);
+        pthread_mutex_lock(&stage->lock);
+        if ((failed != 0) && (stage->ret == 0)) stage->ret = failed;
+        buf->len = 0;
+        pipe_ring_put(&stage->empty, buf);
+        pthread_cond_broadcast(&stage->changed);
+    }
+    pthread_mutex_unlock(&stage->lock);
+    return NULL;
+}
+
+#endif
+
+#ifdef ULZ77C_URING
+
+/* Set up the ring of stage with its buffers registered, buffers which
+ * are not registered (over the limit of locked memory) work as well */
+static int pipe_uring_init(struct pipe_stage *stage)
+{
+    struct iovec vec[PIPE_DEPTH];
+    int i;
+
+    /* every buffer is in flight at most once */
+    if (io_uring_queue_init((unsigned int)stage->depth * 2, &stage->ring, 0) != 0) return -1;
+    for (i = 0; i < stage->depth; i++)
+    {
+        vec[i].iov_base = stage->buffers[i].data;
+        vec[i].iov_len = stage->capacity;
+    }
+    stage->registered = (io_uring_register_buffers(&stage->ring, vec, (unsigned int)stage->depth) == 0);
+    return 0;
+}
+
+/* Queue the read or write of the rest of buffer */
+static void pipe_uring_prep(struct pipe_stage *stage, struct pipe_buffer *buf)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&stage->ring);
+    unsigned char *data = buf->data + buf->done;
+    unsigned int len = (unsigned int)(buf->want - buf->done);
+    uint64_t offset = buf->offset + buf->done;
+    int index = (int)(buf - stage->buffers);
+
+    if (stage->writing && stage->registered)
+        io_uring_prep_write_fixed(sqe, stage->fd, data, len, offset, index);
+    else if (stage->writing)
+        io_uring_prep_write(sqe, stage->fd, data, len, offset);
+    else if (stage->registered)
+        io_uring_prep_read_fixed(sqe, stage->fd, data, len, offset, index);
+    else
+        io_uring_prep_read(sqe, stage->fd, data, len, offset);
+    io_uring_sqe_set_data(sqe, buf);
+    buf->queued = 1;
+    buf->completed = 0;
+}
+
+/* Submit the transfers queued and wait for one to complete at least,
+ * a short one is queued again for the rest, return the first error */
+static int pipe_uring_wait(struct pipe_stage *stage, int *in_flight)
+{
+    struct io_uring_cqe *cqe;
+    struct pipe_buffer *buf;
+    int ret = 0, res, i;
+
+    io_uring_submit(&stage->ring);
+    while ((res = io_uring_wait_cqe(&stage->ring, &cqe)) == -EINTR);
+    if (res != 0)
+    {
+        /* the buffers in flight are given up, so that they are recycled
+         * and the main thread gets the error */
+        for (i = 0; i < stage->depth; i++)
+        {
+            buf = &stage->buffers[i];
+            if (buf->queued == 0) continue;
+            buf->queued = 0;
+            buf->completed = 1;
+            (*in_flight)--;
+        }
+        return stage->writing ? -ULZ77_ERR_FILE_WRITE : -ULZ77_ERR_FILE_READ;
+    }
+
+    do
+    {
+        buf = (struct pipe_buffer *)io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&stage->ring, cqe);
+        buf->queued = 0;
+        (*in_flight)--;
+        /* no data before the end is the source shrinking */
+        if (res <= 0)
+        {
+            if (ret == 0) ret = stage->writing ? -ULZ77_ERR_FILE_WRITE : -ULZ77_ERR_FILE_READ;
+            buf->completed = 1;
+            continue;
+        }
+        buf->done += (size_t)res;
+        if (buf->done < buf->want)
+        {
+            pipe_uring_prep(stage, buf);
+            (*in_flight)++;
+        }
+        else
+        {
+            buf->completed = 1;
+        }
+    } while (io_uring_peek_cqe(&stage->ring, &cqe) == 0);
+
+    return ret;
+}
+
+/* Read the source into every empty buffer at once, buffers read are
+ * handed over in order, a buffer of no data is the end */
+static void *pipe_uring_reader(void *arg)
+{
+    struct pipe_stage *stage = (struct pipe_stage *)arg;
+    struct pipe_buffer *buf;
+    uint64_t next_seq = 0, deliver_seq = 0;
+    int in_flight = 0, failed, progress, i;
+
+    pthread_mutex_lock(&stage->lock);
+    for (;;)
+    {
+        while ((stage->closed == 0) && (stage->ret == 0) && (stage->offset < stage->size) && \
+                (stage->empty.head != stage->empty.tail))
+        {
+            buf = stage->empty.slots[stage->empty.head++ % PIPE_DEPTH];
+            buf->offset = stage->offset;
+            buf->want = (size_t)MIN((uint64_t)stage->capacity, stage->size - stage->offset);
+            buf->done = 0;
+            buf->seq = next_seq++;
+            stage->offset += buf->want;
+            pipe_uring_prep(stage, buf);
+            in_flight++;
+        }
+        if (in_flight == 0)
+        {
+            if (stage->closed != 0) break;
+            if ((stage->ret != 0) || (stage->offset >= stage->size))
+            {
+                /* the main thread stops at the end and gets the error */
+                if ((buf = pipe_ring_take(stage, &stage->empty)) != NULL)
+                {
+                    buf->len = 0;
+                    pipe_ring_put(&stage->ready, buf);
+                    pthread_cond_broadcast(&stage->changed);
+                }
+                break;
+            }
+            pthread_cond_wait(&stage->changed, &stage->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&stage->lock);
+        failed = pipe_uring_wait(stage, &in_flight);
+        pthread_mutex_lock(&stage->lock);
+        if ((failed != 0) && (stage->ret == 0)) stage->ret = failed;
+        do
+        {
+            progress = 0;
+            for (i = 0; i < stage->depth; i++)
+            {
+                buf = &stage->buffers[i];
+                if (buf->completed == 0) continue;
+                if (stage->ret != 0)
+                {
+                    /* after an error buffers only go back for the end */
+                    buf->completed = 0;
+                    pipe_ring_put(&stage->empty, buf);
+                }
+                else if (buf->seq == deliver_seq)
+                {
+                    buf->completed = 0;
+                    buf->len = buf->done;
+                    pipe_ring_put(&stage->ready, buf);
+                    deliver_seq++;
+                    progress = 1;
+                }
+            }
+        } while (progress);
+        pthread_cond_broadcast(&stage->changed);
+    }
+    pthread_mutex_unlock(&stage->lock);
+    return NULL;
+}
+
+/* Write every ready buffer at once at its offset till the stage is
+ * closed, after an error they are only recycled */
+static void *pipe_uring_writer(void *arg)
+{
+    struct pipe_stage *stage = (struct pipe_stage *)arg;
+    struct pipe_buffer *buf;
+    int in_flight = 0, failed, i;
+
+    pthread_mutex_lock(&stage->lock);
+    for (;;)
+    {
+        while (stage->ready.head != stage->ready.tail)
+        {
+            buf = stage->ready.slots[stage->ready.head++ % PIPE_DEPTH];
+            if ((stage->ret != 0) || (buf->len == 0))
+            {
+                buf->len = 0;
+                pipe_ring_put(&stage->empty, buf);
+                pthread_cond_broadcast(&stage->changed);
+                continue;
+            }
+            buf->offset = stage->offset;
+            buf->want = buf->len;
+            buf->done = 0;
+            stage->offset += buf->len;
+            pipe_uring_prep(stage, buf);
+            in_flight++;
+        }
+        if (in_flight == 0)
+        {
+            if (stage->closed != 0) break;
+            pthread_cond_wait(&stage->changed, &stage->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&stage->lock);
+        failed = pipe_uring_wait(stage, &in_flight);
+        pthread_mutex_lock(&stage->lock);
+        if ((failed != 0) && (stage->ret == 0)) stage->ret = failed;
+        for (i = 0; i < stage->depth; i++)
+        {
+            buf = &stage->buffers[i];
+            if (buf->completed == 0) continue;
+            buf->completed = 0;
+            buf->len = 0;
+            pipe_ring_put(&stage->empty, buf);
+        }
+        pthread_cond_broadcast(&stage->changed);
+    }
+    pthread_mutex_unlock(&stage->lock);
+    return NULL;
+}
+
+#endif
+
+/* Free buffers of stage */
+static void pipe_free(struct pipe_stage *stage)
+{
+    int i;
+
+    for (i = 0; i < stage->depth; i++)
+    {
+        if (stage->buffers[i].data != NULL) free(stage->buffers[i].data);
+        stage->buffers[i].data = NULL;
+    }
+}
+
+/* Allocate buffers of stage and start its thread, depth is the number
+ * of buffers, io falls back to pread() without io_uring and to stdio if
+ * the file has no offsets */
+static int pipe_start(struct pipe_stage *stage, FILE *fp, int writing, size_t capacity, int depth, int io)
+{
+    int i;
+#ifdef ULZ77C_THREADS
+    void *(*worker)(void *);
+#endif
+#ifdef ULZ77C_POSIX
+    struct stat st;
+#endif
+
+    memset(stage, 0, sizeof(struct pipe_stage));
+    stage->fp = fp;
+    stage->writing = writing;
+    stage->capacity = capacity;
+    stage->io = PIPE_IO_STDIO;
+    stage->fd = -1;
+#ifdef ULZ77C_POSIX
+    /* files are just opened, offsets start from 0 */
+    if ((io != PIPE_IO_STDIO) && (fstat(fileno(fp), &st) == 0) && S_ISREG(st.st_mode))
+    {
+        stage->io = io;
+        stage->fd = fileno(fp);
+        stage->size = (uint64_t)st.st_size;
+    }
+#else
+    (void)io;
+#endif
+#ifndef ULZ77C_URING
+    if (stage->io == PIPE_IO_URING) stage->io = PIPE_IO_PREAD;
+#endif
+#ifdef ULZ77C_THREADS
+    stage->depth = MIN(MAX(depth, 2), PIPE_DEPTH);
+#else
+    stage->depth = 1;
+    (void)depth;
+#endif
+    for (i = 0; i < stage->depth; i++)
+    {
+        stage->buffers[i].data = (unsigned char *)malloc(sizeof(unsigned char) * capacity);
+        if (stage->buffers[i].data == NULL)
+        {
+            pipe_free(stage);
+            return -ULZ77_ERR_MALLOC;
+        }
+    }
+
+#ifdef ULZ77C_URING
+    if ((stage->io == PIPE_IO_URING) && (pipe_uring_init(stage) != 0)) stage->io = PIPE_IO_PREAD;
+#endif
+
+#ifdef ULZ77C_THREADS
+    worker = writing ? pipe_writer : pipe_reader;
+#ifdef ULZ77C_URING
+    if (stage->io == PIPE_IO_URING) worker = writing ? pipe_uring_writer : pipe_uring_reader;
+#endif
+    for (i = 0; i < stage->depth; i++) pipe_ring_put(&stage->empty, &stage->buffers[i]);
+    pthread_mutex_init(&stage->lock, NULL);
+    pthread_cond_init(&stage->changed, NULL);
+    if (pthread_create(&stage->thread, NULL, worker, stage) != 0)
+    {
+        pthread_cond_destroy(&stage->changed);
+        pthread_mutex_destroy(&stage->lock);
+#ifdef ULZ77C_URING
+        if (stage->io == PIPE_IO_URING) io_uring_queue_exit(&stage->ring);
+#endif
+        pipe_free(stage);
+        return -ULZ77_ERR_THREAD;
+    }
+#endif
+
+    return 0;
+}
+
+/* Stop the thread of stage and free buffers, return the first error of
+ * stage. Buffers still ready are written first */
+static int pipe_stop(struct pipe_stage *stage)
+{
+    if (stage->buffers[0].data == NULL) return stage->ret;
+#ifdef ULZ77C_THREADS
+    pthread_mutex_lock(&stage->lock);
+    stage->closed = 1;
+    pthread_cond_broadcast(&stage->changed);
+    pthread_mutex_unlock(&stage->lock);
+    pthread_join(stage->thread, NULL);
+#ifdef ULZ77C_URING
+    if (stage->io == PIPE_IO_URING) io_uring_queue_exit(&stage->ring);
+#endif
+    pthread_cond_destroy(&stage->changed);
+    pthread_mutex_destroy(&stage->lock);
+#endif
+    pipe_free(stage);
+    return stage->ret;
+}
+
+/* Get the next buffer read from the source, of no data at the end */
+static struct pipe_buffer *pipe_read(struct pipe_stage *stage)
+{
+#ifdef ULZ77C_THREADS
+    struct pipe_buffer *buf;
+
+    pthread_mutex_lock(&stage->lock);
+    buf = pipe_ring_take(stage, &stage->ready);
+    pthread_mutex_unlock(&stage->lock);
+    return buf;
+#else
+    struct pipe_buffer *buf = &stage->buffers[0];
+
+    if ((stage->ret = pipe_io_read(stage, buf)) != 0) buf->len = 0;
+    return buf;
+#endif
+}
+
+/* Give a buffer read back to the reader */
+static void pipe_recycle(struct pipe_stage *stage, struct pipe_buffer *buf)
+{
+#ifdef ULZ77C_THREADS
+    pthread_mutex_lock(&stage->lock);
+    pipe_ring_put(&stage->empty, buf);
+    pthread_cond_broadcast(&stage->changed);
+    pthread_mutex_unlock(&stage->lock);
+#else
+    (void)stage;
+    (void)buf;
+#endif
+}
+
+/* Get the buffer being filled for the writer, wait for an empty one if
+ * there is none */
+static struct pipe_buffer *pipe_current(struct pipe_stage *stage)
+{
+    if (stage->current == NULL)
+    {
+#ifdef ULZ77C_THREADS
+        pthread_mutex_lock(&stage->lock);
+        stage->current = pipe_ring_take(stage, &stage->empty);
+        pthread_mutex_unlock(&stage->lock);
+#else
+        stage->current = &stage->buffers[0];
+#endif
+    }
+    return stage->current;
+}
+
+/* Hand the buffer being filled to the writer, return the first error of
+ * writer */
+static int pipe_submit(struct pipe_stage *stage)
+{
+    struct pipe_buffer *buf = stage->current;
+    int ret;
+
+    if ((buf == NULL) || (buf->len == 0)) return stage->ret;
+    stage->current = NULL;
+#ifdef ULZ77C_THREADS
+    pthread_mutex_lock(&stage->lock);
+    pipe_ring_put(&stage->ready, buf);
+    pthread_cond_broadcast(&stage->changed);
+    ret = stage->ret;
+    pthread_mutex_unlock(&stage->lock);
+#else
+    if (stage->ret == 0) stage->ret = pipe_io_write(stage, buf);
+    buf->len = 0;
+    ret = stage->ret;
+#endif
+    return ret;
+}
+
+/* Take len bytes more into the buffer being filled, which is handed to
+ * the writer when it is full */
+static int pipe_commit(struct pipe_stage *stage, size_t len)
+{
+    stage->current->len += len;
+    return (stage->current->len == stage->capacity) ? pipe_submit(stage) : 0;
+}
+
+/* Copy data into buffers of the writer */
+static int pipe_write(struct pipe_stage *stage, const unsigned char *data, size_t len)
+{
+    struct pipe_buffer *buf;
+    size_t n;
+    int ret;
+
+    while (len != 0)
+    {
+        buf = pipe_current(stage);
+        n = MIN(len, stage->capacity - buf->len);
+        memcpy(buf->data + buf->len, data, n);
+        data += n;
+        len -= n;
+        if ((ret = pipe_commit(stage, n)) != 0) return ret;
+    }
+    return 0;
+}
+
+/* Writer callback of stream, opaque is the writer stage */
+static int stream_pipe_write(void *opaque, const struct ulz77_iovec *iov, int iov_count)
+{
+    struct pipe_stage *stage = (struct pipe_stage *)opaque;
+    int ret = 0, i;
+
+    for (i = 0; (i < iov_count) && (ret == 0); i++)
+        ret = pipe_write(stage, iov[i].data, iov[i].size);
+    return ret;
+}
+
+int ulz77_stream_compress(char *filename_dst, char *filename_src, size_t bs, const struct ulz77_params *params, int threads, int seekable, int io)
 {
     int ret = 0;
     struct ulz77_stream *stream = NULL;
     FILE *fp_src = NULL, *fp_dst = NULL;
-    long fp_src_len = 0;
-    unsigned char *buffer = NULL;
-    long remain_size, task_size;
+    struct pipe_stage reader, writer;
+    struct pipe_buffer *buf;
+    int ret_stage;
+
+    memset(&reader, 0, sizeof(struct pipe_stage));
+    memset(&writer, 0, sizeof(struct pipe_stage));
 
     /* Create stream */
     stream = ulz77_stream_new();
@@ -109,57 +975,98 @@ int ulz77_stream_compress(char *filename_dst, char *filename_src, size_t bs)
         goto fail;
     }
 
-    /* Set write file pointer */
-    ret = ulz77_stream_set_writer_fp(stream, fp_dst);
+    /* Blocks go to the writer thread */
+    ret = pipe_start(&writer, fp_dst, 1, PIPE_WRITE_SIZE, PIPE_DEPTH, io);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+    ret = ulz77_stream_set_writer_iov_callback(stream, stream_pipe_write, &writer);
     if (ret != 0)
     {
         goto fail;
     }
 
-    /* Get length of source file */
-    fseek(fp_src, 0, SEEK_END);
-    fp_src_len = ftell(fp_src);
-    fseek(fp_src, 0, SEEK_SET);
-    remain_size = fp_src_len;
+    /* Set compression level and window */
+    ret = ulz77_stream_set_params(stream, params);
+    if (ret != 0)
+    {
+        goto fail;
+    }
 
-    buffer = (unsigned char *)malloc(sizeof(unsigned char) * bs);
-    if (buffer == NULL)
+    /* Set threads compressing blocks */
+    ret = ulz77_stream_set_threads(stream, threads);
+    if (ret != 0)
     {
-        ret = -ULZ77_ERR_MALLOC;
         goto fail;
     }
 
-    while (remain_size != 0)
+    /* Set index of blocks */
+    ret = ulz77_stream_set_seekable(stream, seekable);
+    if (ret != 0)
     {
-        task_size = MIN(remain_size, 1024 * 1024 * 1);
-        if (fread(buffer, task_size, 1, fp_src) < 1)
+        goto fail;
+    }
+
+    /* Blocks of bs bytes until the end, so memory does not grow with
+     * the source, which could be a pipe. The reader thread reads the next
+     * block while this one is compressed, double buffering is enough
+     * unless io_uring keeps reads of several blocks in flight */
+    ret = pipe_start(&reader, fp_src, 0, bs, (io == PIPE_IO_URING) ? PIPE_DEPTH : 2, io);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+    while ((buf = pipe_read(&reader))->len != 0)
+    {
+        ret = ulz77_stream_push(stream, buf->data, buf->len);
+        pipe_recycle(&reader, buf);
+        if (ret != 0)
         {
-            ret = -ULZ77_ERR_FILE_READ;
             goto fail;
         }
-        ulz77_stream_push(stream, buffer, task_size);
+    }
+    if ((ret = pipe_stop(&reader)) != 0)
+    {
+        goto fail;
+    }
 
-        remain_size -= task_size;
+    /* Write blocks still being compressed, and the index */
+    ret = ulz77_stream_end(stream);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+    ret = pipe_submit(&writer);
+    if (ret != 0)
+    {
+        goto fail;
     }
 
     ret = 0;
 fail:
+    /* blocks pushed are written before the writer stops */
     if (stream != NULL) ulz77_stream_destroy(stream);
+    ret_stage = pipe_stop(&reader);
+    if (ret == 0) ret = ret_stage;
+    ret_stage = pipe_stop(&writer);
+    if (ret == 0) ret = ret_stage;
     if (fp_src != NULL) fclose(fp_src);
     if (fp_dst != NULL) fclose(fp_dst);
-    if (buffer != NULL) free(buffer);
     return ret;
 }
 
-int ulz77_stream_decompress(char *filename_dst, char *filename_src)
+int ulz77_stream_decompress(char *filename_dst, char *filename_src, const struct ulz77_dict *dict, int io)
 {
-    int ret = 0;
+    int ret = 0, ret_stage;
     struct ulz77_stream *stream = NULL;
     FILE *fp_src = NULL, *fp_dst = NULL;
-    long fp_src_len = 0;
-    unsigned char *dst = NULL;
-    size_t dst_len;
-    long remain_size;
+    struct pipe_stage reader, writer;
+    struct pipe_buffer *src, *dst;
+    size_t src_used, dst_len, src_pos;
+
+    memset(&reader, 0, sizeof(struct pipe_stage));
+    memset(&writer, 0, sizeof(struct pipe_stage));
 
     /* Create stream */
     stream = ulz77_stream_new();
@@ -185,34 +1092,67 @@ int ulz77_stream_decompress(char *filename_dst, char *filename_src)
         goto fail;
     }
 
-    /* Set write file pointer */
-    ret = ulz77_stream_set_reader_fp(stream, fp_src);
+    /* Set dictionary blocks were compressed with */
+    ret = ulz77_stream_set_dict(stream, dict);
     if (ret != 0)
     {
         goto fail;
     }
 
-    /* Get length of source file */
-    fseek(fp_src, 0, SEEK_END);
-    fp_src_len = ftell(fp_src);
-    fseek(fp_src, 0, SEEK_SET);
-    remain_size = fp_src_len;
+    /* Input is pushed in fixed pieces read by the reader thread, and
+     * decoded straight into buffers of the writer thread, so blocks of
+     * any size decode within them */
+    ret = pipe_start(&reader, fp_src, 0, FEED_BUFFER_SIZE, PIPE_DEPTH, io);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+    ret = pipe_start(&writer, fp_dst, 1, FEED_BUFFER_SIZE, PIPE_DEPTH, io);
+    if (ret != 0)
+    {
+        goto fail;
+    }
 
-    while (remain_size != 0)
+    while ((src = pipe_read(&reader))->len != 0)
     {
-        ret = ulz77_stream_pull(stream, &dst, &dst_len);
-        if (ret != 0)
+        src_pos = 0;
+        do
         {
-            goto fail;
-        }
-        fwrite(dst, dst_len, 1, fp_dst);
-        free(dst);
-        remain_size -= stream->reader_count;
+            dst = pipe_current(&writer);
+            ret = ulz77_stream_feed(stream, dst->data + dst->len, FEED_BUFFER_SIZE - dst->len, &dst_len, \
+                    src->data + src_pos, src->len - src_pos, &src_used);
+            if ((ret != 0) && (ret != -ULZ77_ERR_BUFFER_FULL))
+            {
+                goto fail;
+            }
+            src_pos += src_used;
+            ret_stage = pipe_commit(&writer, dst_len);
+            if (ret_stage != 0)
+            {
+                ret = ret_stage;
+                goto fail;
+            }
+        } while (ret == -ULZ77_ERR_BUFFER_FULL);
+        pipe_recycle(&reader, src);
+    }
+    if ((ret = pipe_stop(&reader)) != 0)
+    {
+        goto fail;
     }
 
-    ret = 0;
+    /* Source ending in a block is truncated */
+    ret = ulz77_stream_feed_end(stream);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+    ret = pipe_submit(&writer);
 fail:
     if (stream != NULL) ulz77_stream_destroy(stream);
+    ret_stage = pipe_stop(&reader);
+    if (ret == 0) ret = ret_stage;
+    ret_stage = pipe_stop(&writer);
+    if (ret == 0) ret = ret_stage;
     if (fp_src != NULL) fclose(fp_src);
     if (fp_dst != NULL) fclose(fp_dst);
     return ret;
@@ -227,12 +1167,30 @@ int main(int argc, const char *argv[])
     char *src_file = NULL;
     char *dst_file = NULL;
     size_t bs = 1024 * 1024 * 1;  /* 1M */
+    int threads = 1;
+    int seekable = 0;
+    int mapped = 0;
+    int io = PIPE_IO_STDIO;
+    struct ulz77_params params;
+    struct ulz77_dict *dict = NULL;
+    char **sample_files = NULL;
+    int sample_count = 0;
+    size_t dict_size = 32 * 1024;  /* 32K */
 
     /* Argument Parser */
     int arg_idx;
     char *arg_p;
     argsparse_init(&arg_idx);
 
+    ulz77_params_init(&params);
+
+    sample_files = (char **)malloc(sizeof(char *) * (size_t)argc);
+    if (sample_files == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto fail;
+    }
+
     /* Parse arguments */
     while (argsparse_request(argc, argv, &arg_idx, &arg_p) == 0)
     {
@@ -275,6 +1233,141 @@ int main(int argc, const char *argv[])
             }
             dst_file = arg_p;
         }
+        else if (!strcmp(arg_p, "--level"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            params.level = (!strcmp(arg_p, "max")) ? ULZ77_LEVEL_MAX : atoi(arg_p);
+            if ((params.level < ULZ77_LEVEL_MIN) || (params.level > ULZ77_LEVEL_MAX))
+            {
+                fprintf(stderr, "Error : Invalid compression level\n"); ret = 0;
+                goto fail;
+            }
+        }
+        else if (!strcmp(arg_p, "--window"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            params.window_log = parse_window_log(arg_p);
+            if (params.window_log == 0)
+            {
+                fprintf(stderr, "Error : Invalid window size\n"); ret = 0;
+                goto fail;
+            }
+        }
+        else if (!strcmp(arg_p, "-bs"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            bs = parse_size(arg_p);
+            if ((bs == 0) || (bs > (1 << 30)))
+            {
+                fprintf(stderr, "Error : Invalid block size\n"); ret = 0;
+                goto fail;
+            }
+        }
+        else if (!strcmp(arg_p, "-T"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            threads = atoi(arg_p);
+            if (threads < 1)
+            {
+                fprintf(stderr, "Error : Invalid number of threads\n"); ret = 0;
+                goto fail;
+            }
+        }
+        else if (!strcmp(arg_p, "--seekable"))
+        {
+            seekable = 1;
+        }
+        else if (!strcmp(arg_p, "--linked"))
+        {
+            params.flags |= ULZ77_FLAG_LINKED;
+        }
+        else if (!strcmp(arg_p, "--mmap"))
+        {
+            mapped = 1;
+        }
+        else if (!strcmp(arg_p, "--io"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            if (!strcmp(arg_p, "stdio"))
+            {
+                io = PIPE_IO_STDIO;
+            }
+            else if (!strcmp(arg_p, "pread"))
+            {
+                io = PIPE_IO_PREAD;
+            }
+            else if (!strcmp(arg_p, "uring"))
+            {
+                io = PIPE_IO_URING;
+            }
+            else
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+        }
+        else if (!strcmp(arg_p, "--sequence"))
+        {
+            params.flags |= ULZ77_FLAG_SEQUENCE;
+        }
+        else if (!strcmp(arg_p, "--entropy"))
+        {
+            params.flags |= ULZ77_FLAG_ENTROPY;
+        }
+        else if (!strcmp(arg_p, "-D"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            if (dict != NULL) ulz77_dict_destroy(dict);
+            dict = load_dict(arg_p);
+            if (dict == NULL)
+            {
+                fprintf(stderr, "Error : Invalid dictionary\n"); ret = 0;
+                goto fail;
+            }
+            params.dict = dict;
+        }
+        else if (!strcmp(arg_p, "--train"))
+        {
+            mode = ULZ77C_MODE_TRAIN;
+        }
+        else if (!strcmp(arg_p, "--maxdict"))
+        {
+            if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
+            {
+                fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+                goto fail;
+            }
+            dict_size = parse_size(arg_p);
+            if ((dict_size == 0) || (dict_size > ULZ77_DICT_SIZE_MAX))
+            {
+                fprintf(stderr, "Error : Invalid dictionary size\n"); ret = 0;
+                goto fail;
+            }
+        }
         else if (!strcmp(arg_p, "--method"))
         {
             if (argsparse_request(argc, argv, &arg_idx, &arg_p) != 0)
@@ -296,6 +1389,11 @@ int main(int argc, const char *argv[])
                 goto fail;
             }
         }
+        else if (arg_p[0] != '-')
+        {
+            /* samples of training */
+            sample_files[sample_count++] = arg_p;
+        }
         else
         {
             fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
@@ -303,7 +1401,13 @@ int main(int argc, const char *argv[])
         }
     }
 
-    if (src_file == NULL)
+    if ((sample_count != 0) && (mode != ULZ77C_MODE_TRAIN))
+    {
+        fprintf(stderr, "Error : Invalid argument\n"); ret = 0;
+        goto fail;
+    }
+
+    if ((src_file == NULL) && (mode != ULZ77C_MODE_TRAIN))
     {
         fprintf(stderr, "Error : Not specified source file\n"); ret = 0;
         goto fail;
@@ -315,26 +1419,48 @@ int main(int argc, const char *argv[])
         goto fail;
     }
 
-    if (mode == ULZ77C_MODE_COMPRESSION)
+    if (mode == ULZ77C_MODE_TRAIN)
+    {
+        if (sample_count == 0)
+        {
+            fprintf(stderr, "Error : Not specified samples\n"); ret = 0;
+            goto fail;
+        }
+        /* matches never reach beyond the window */
+        ret = ulz77_train(dst_file, sample_files, sample_count, MIN(dict_size, (size_t)1 << params.window_log), &params);
+    }
+    else if (mode == ULZ77C_MODE_COMPRESSION)
     {
         if (method == ULZ77C_METHOD_FILE)
         {
-            ret = ulz77_compress_file(dst_file, src_file);
+            if (mapped)
+                ret = ulz77_compress_file_mmap(dst_file, src_file, &params);
+            else
+                ret = ulz77_compress_file_params(dst_file, src_file, &params);
         }
         else
         {
-            ret = ulz77_stream_compress(dst_file, src_file, bs);
+            ret = ulz77_stream_compress(dst_file, src_file, bs, &params, threads, seekable, io);
         }
     }
     else if (mode == ULZ77C_MODE_DECOMPRESSION)
     {
         if (method == ULZ77C_METHOD_FILE)
         {
-            ret = ulz77_decompress_file(dst_file, src_file);
+            if (mapped)
+                ret = ulz77_decompress_file_mmap_dict(dst_file, src_file, dict);
+            else if (dict != NULL)
+                ret = ulz77_decompress_file_dict(dst_file, src_file, dict);
+            else
+                ret = ulz77_decompress_file(dst_file, src_file);
         }
         else
         {
-            ret = ulz77_stream_decompress(dst_file, src_file);
+            /* blocks are independent, decode them at their offsets */
+            if (threads > 1)
+                ret = ulz77_decompress_stream_file_dict(dst_file, src_file, dict, threads);
+            else
+                ret = ulz77_stream_decompress(dst_file, src_file, dict, io);
         }
     }
     if (ret != 0) goto fail;
@@ -346,6 +1472,8 @@ fail:
         ulz77_error_description_print(ret);
     }
 done:
+    if (dict != NULL) ulz77_dict_destroy(dict);
+    if (sample_files != NULL) free(sample_files);
     return 0;
 }
 
@@ -27,6 +27,27 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if !defined(_WIN32)
+#define ULZ77_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#if defined(ULZ77_POSIX) && !defined(ULZ77_NO_THREADS)
+#define ULZ77_THREADS
+#include <pthread.h>
+#endif
 #include "ulz77.h"
 
 #ifndef MAX
@@ -36,6 +57,15 @@
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
 
+/* 64-bit file offsets */
+#if defined(_MSC_VER)
+#define ulz77_fseek _fseeki64
+#define ulz77_ftell _ftelli64
+#else
+#define ulz77_fseek fseeko
+#define ulz77_ftell ftello
+#endif
+
 /* Compiler related functions */
 #ifdef __builtin_expect
 #define expect(expr, value) (__builtin_expect((expr),(value)))
@@ -43,8 +73,46 @@
 #define expect(expr, value) (expr)
 #endif
 
+/* Allocator of library, set by ulz77_set_allocator() */
+static void *default_alloc(void *opaque, size_t size) { (void)opaque; return malloc(size); }
+static void *default_realloc(void *opaque, void *ptr, size_t size) { (void)opaque; return realloc(ptr, size); }
+static void default_free(void *opaque, void *ptr) { (void)opaque; free(ptr); }
+static struct ulz77_allocator allocator = { default_alloc, default_realloc, default_free, NULL };
+
+static __inline void *mem_alloc(size_t size)
+{
+    return allocator.alloc_fn(allocator.opaque, size);
+}
+
+static __inline void *mem_calloc(size_t count, size_t size)
+{
+    void *ptr;
+
+    if ((size != 0) && (count > (size_t)-1 / size)) return NULL;
+    ptr = allocator.alloc_fn(allocator.opaque, count * size);
+    if (ptr != NULL) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static __inline void *mem_realloc(void *ptr, size_t size)
+{
+    return allocator.realloc_fn(allocator.opaque, ptr, size);
+}
+
+static __inline void mem_free(void *ptr)
+{
+    allocator.free_fn(allocator.opaque, ptr);
+}
+
+/* Parts of static encoders and decoders start at cache lines */
+#define WORKSPACE_ALIGN (64)
+#define WORKSPACE_ALIGN_UP(size) (((size) + WORKSPACE_ALIGN - 1) & ~((size_t)WORKSPACE_ALIGN - 1))
+
 /***************************************************************************
- * A matched pattern will be encoded into at least 3 bytes
+ * Format v1 (decoding only)
+ *
+ * The first 3 bytes are raw, a matched pattern will be encoded into at
+ * least 3 bytes
  *
  * 8 bits     4 bits           12 bits            7 bits          1 bit
  * sentinel + matched length + matched position + (extra length + extra sig)
@@ -56,1085 +124,4815 @@
  * 4               1
  * 17              14
  * 18              15, 1 | 0(no extra)
- * 
+ *
+ ***************************************************************************
+ * Format v2
+ *
+ * Header
+ *
+ * 24 bits   8 bits     8 bits    8 bits       8 bits  varint
+ * "ULZ"   + sentinel + version + window log + flags + content size
+ *         + (32 bits of dictionary ID, flag ULZ77_FLAG_DICT)
+ *
+ * The sentinel and version form a v1 match of length 3, which is never
+ * produced by v1 encoder, so the data of v1 would not be taken as v2.
+ *
+ * A matched pattern will be encoded into at least 2 bytes
+ *
+ * 8 bits     4 bits           1 bit            3 bits
+ * sentinel + matched length + more distance + distance - 1 (low bits)
+ *          + (varint of the rest bits of distance - 1)
+ *          + (varint of matched length - 18, when matched length is 15)
+ *
+ * SENTINEL + 0 means source data is a SENTINEL
+ *
+ * Matched length  Encoded value
+ * 4               1
+ * 17              14
+ * 18              15, 0
+ *
+ * A varint is 7 bits per byte, lowest bits first, the highest bit is
+ * set when more bytes follow. The distance may be shorter than the
+ * matched length, which repeats the recent bytes.
+ *
+ * Sequences (flag ULZ77_FLAG_SEQUENCE)
+ *
+ * Tokens are replaced by sequences of a literal run and a match, the
+ * literals are raw and no byte is escaped
+ *
+ * 4 bits           4 bits
+ * literal length + matched length - 4
+ *                + (varint of literal length - 15, when literal length is 15)
+ *                + literals
+ *                + varint of distance
+ *                + (varint of matched length - 19, when matched length is 15)
+ *
+ * Distance 0 means a sequence of literals only, the last sequence of
+ * data might end right after its literals.
+ *
+ * Entropy coding (flag ULZ77_FLAG_ENTROPY, with ULZ77_FLAG_SEQUENCE)
+ *
+ * Sequences are split into 3 streams: tokens, literals and the varints
+ * (literal lengths, distances and matched lengths). Each stream is
+ *
+ * 8 bits   varint
+ * mode   + raw size + (raw bytes, mode 0)
+ *                   + (code lengths + varint of coded size + bits, mode 1)
+ *                   + (the byte repeated, mode 2)
+ *
+ * Mode 1 is canonical Huffman coding, code lengths of 256 symbols are
+ * 4 bits each (the lower bits first), codes are no longer than 11 bits
+ * and packed from the lowest bit of each byte.
+ *
+ * Linked blocks (flag ULZ77_FLAG_LINKED)
+ *
+ * The encoder keeps its window from one block to the next, a linked block
+ * may refer to the output of the previous block, whose last window size
+ * bytes are kept by the decoder. The first block of a chain is not linked,
+ * the decoder begins it with no window.
+ *
+ * Preset dictionary (flag ULZ77_FLAG_DICT)
+ *
+ * The dictionary comes right before the oldest byte of the window, a
+ * distance longer than the data decoded so far (with the window of the
+ * previous linked block) refers to the dictionary from its end.
+ *
+ * Stream
+ *
+ * Blocks are written with their sizes (32 bits, little endian). A
+ * seekable stream ends with a block of index, which takes version 15 and
+ * is skipped when pulled
+ *
+ * 24 bits   8 bits     8 bits  varint
+ * "ULZ"   + sentinel + 15    + number of blocks
+ *                            + (varint of block size + varint of content
+ *                               size) of each block
+ *                            + 32 bits of the size of index block
+ *                            + "ULZI"
+ *
  ***************************************************************************/
 
-#define BUFFER_SIZE 4096 /* Size of ring buffer */
+#define BUFFER_SIZE 4096 /* Size of ring buffer of format v1 */
 #define MATCH_LEN_MAX (15 + 3) /* Match longer than this value should be put 
                                   into extra bytes */
 #define MATCH_LEN_MIN (4)
+#define MATCH_LEN_LIMIT (1 << 20) /* longest match of format v2 */
 #define SENTINEL 255
 
-/* Return the true position in ring with specified offset 
- * relative to the beginning of ring */
-#define BUFCVT_FROM_RELATIVE(idx_relative, br) \
-    ((idx_relative)+(br->second_pass?\
-        (br->pos+(((idx_relative)<(signed int)((br->size)-(br->pos)))?\
-                  (0)\
-                  :(-(signed int)(br->size))))\
-        :(0)))
+/* Header of format v2 */
+#define HEADER_MAGIC "ULZ"
+#define HEADER_MAGIC_SIZE (3)
+#define HEADER_FIXED_SIZE (7) /* without content size */
+#define HEADER_FLAGS_SUPPORTED (ULZ77_FLAG_SEQUENCE | ULZ77_FLAG_ENTROPY | ULZ77_FLAG_LINKED | ULZ77_FLAG_DICT)
+
+/* Index of seekable stream */
+#define INDEX_VERSION (15)
+#define INDEX_MAGIC "ULZI"
+#define INDEX_FOOTER_SIZE (8) /* size of index block and magic */
+
+/* Bytes reserved for the token, literal length, distance and matched
+ * length of a sequence */
+#define SEQUENCE_RESERVED_SIZE (16)
+
+/* Entropy coding */
+#define STREAM_COUNT (3) /* tokens, literals and varints */
+#define STREAM_MODE_RAW (0)
+#define STREAM_MODE_HUFFMAN (1)
+#define STREAM_MODE_REPEAT (2)
+#define STREAM_HEADER_SIZE_MAX (1 + 10 + HUFFMAN_LENGTHS_SIZE + 10)
+#define STREAM_RAW_HEADER_SIZE_MAX (1 + 10) /* a stream is coded only if it is shorter than raw */
+#define HUFFMAN_LEN_MAX (11)
+#define HUFFMAN_TABLE_SIZE (1 << HUFFMAN_LEN_MAX)
+#define HUFFMAN_LENGTHS_SIZE (LITERAL_SIZE / 2) /* 4 bits per symbol */
+
+/* A stream of entropy coded block */
+struct entropy_stream
+{
+    int mode;
+    size_t raw_size;
+    const unsigned char *data; /* coded bytes, code lengths of Huffman mode excluded */
+    size_t data_len;
+    const unsigned char *lengths; /* code lengths (Huffman) */
+};
+
+/* Information from header */
+struct ulz77_header
+{
+    int format;
+    unsigned int window_log;
+    unsigned int flags;
+    uint64_t content_size;
+    uint32_t dict_id; /* ULZ77_FLAG_DICT */
+    size_t header_len;
+};
 
-#define RELATIVE_TO_ABSOLUTE(idx_relative, br) \
-    (((br->absolute_pos)-(br->grow))+(idx_relative))
+/* Preset dictionary, positions in tables are 1-based, 0 for none */
+struct ulz77_dict
+{
+    unsigned char *content;
+    uint32_t len;
+    uint32_t id;
+    unsigned int hash_shift; /* the hash of encoder shifted right indexes head_table */
+    uint32_t *head_table; /* the last position of each hash value */
+    uint32_t *chain_table; /* previous position of the same hash value */
+};
 
-#define ABSOLUTE_TO_RELATIVE(idx_absolute, br) \
-    (idx_absolute-(br->absolute_pos-br->grow))
+/* Return the address of specified absolute position in ring, 
+ * the following (size) bytes are contiguous since the ring is mirrored */
+#define BUFFER_RING_PTR(absolute_pos, br) \
+    ((br)->buf + ((absolute_pos) & ((br)->size - 1)))
 
-#define NO_WHERE (-1) /* for jump table, indicates no where to jump */
 #define LITERAL_SIZE (256)
 
-/* initialize ring buffer data structure */
-static int buffer_ring_init(struct buffer_ring *br, unsigned int size)
+/* Rebase absolute positions before they overflow */
+#define ABSOLUTE_POS_LIMIT (0x80000000U)
+
+/* Compression levels
+ * Higher levels visit more candidates of the hash chain, accept a
+ * longer match before giving up searching and look further ahead for
+ * a longer match before taking the current one. The max level parses
+ * optimally and takes a match of good_len at once */
+static const struct ulz77_level ulz77_levels[ULZ77_LEVEL_MAX + 1] =
+{
+    /* max_chain, good_len, lazy, optimal */
+    {    0,    0, 0, 0 }, /* 0 */
+    {    4,   16, 0, 0 }, /* 1 */
+    {    8,   24, 0, 0 }, /* 2 */
+    {   16,   32, 0, 0 }, /* 3 */
+    {   32,   64, 1, 0 }, /* 4 */
+    {   64,  128, 1, 0 }, /* 5 */
+    {  128,  258, 1, 0 }, /* 6 */
+    {  256, 1024, 2, 0 }, /* 7 */
+    { 1024, 4096, 2, 0 }, /* 8 */
+    { 4096,    0, 2, 0 }, /* 9 */
+    { 4096, 4096, 0, 1 }, /* 10, max */
+};
+
+/* Optimal parsing */
+#define OPT_SIZE (1 << 16) /* positions parsed at once */
+#define OPT_MATCHES (32) /* candidate matches kept per position */
+
+/* Pushed input of stream */
+#define FEED_TOKEN_MAX (16) /* no token with its varints is longer */
+#define FEED_STAGE_SIZE (64 * 1024) /* input staged at once, entropy coded blocks are staged whole */
+
+/* Dictionary training */
+#define TRAIN_DMER_SIZE (8) /* bytes of a substring counted by training */
+#define TRAIN_HASH_BIT_MAX (22)
+#define TRAIN_SEGMENT_MIN (64)
+#define TRAIN_SEGMENT_MAX (1024)
+#define TRAIN_INVALID (0xFFFFFFFFU) /* substring crossing the end of a sample */
+
+/* A candidate match of optimal parsing */
+struct opt_match
+{
+    unsigned int distance;
+    unsigned int len;
+};
+
+/* Read the literal used to compute hash */
+static __inline uint32_t read_u32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return value;
+}
+
+/* Read 8 bytes for comparing */
+static __inline uint64_t read_u64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(uint64_t));
+    return value;
+}
+
+/* Read 32-bit little-endian integer, as sizes of stream blocks are stored */
+static __inline uint32_t read_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Count trailing zero bits of a non-zero word */
+static __inline unsigned int count_trailing_zeros(uint64_t x)
 {
-#if defined(USE_MATCH_CHAIN)
-    int chain_idx;
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long idx;
+    _BitScanForward64(&idx, x);
+    return (unsigned int)idx;
+#else
+    unsigned int n = 0;
+    while ((x & 1) == 0) { x >>= 1; n++; }
+    return n;
 #endif
-    unsigned int i;
+}
 
-    /* Clean pointers */
-    br->buf = NULL;
-    br->first_table = br->final_table = br->hash_jump_next_table = NULL;
-    /* Allocate body for ring */
-    br->buf = (unsigned char *)malloc(sizeof(unsigned char) * size);
-    if (br->buf == NULL) goto fail;
-    /* Basic settings */
-    for (i = 0; i != ULZ77_RECENT_POS_SIZE; i++)
-        br->recent_pos[i] = 0; /* Recent positions when added */
-    br->pos = 0; 
-    br->grow = 0;
-    br->size = size;
-    br->second_pass = 0;
-    br->absolute_pos = 0;
-#if defined(USE_MATCH_CHAIN)
-    for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
+/* Count the equal leading bytes of 2 words which differ */
+static __inline unsigned int count_equal_bytes(uint64_t diff)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    return (unsigned int)__builtin_clzll(diff) >> 3;
+#else
+    return count_trailing_zeros(diff) >> 3;
+#endif
+}
+
+/* Return the length of common prefix of a and b, no longer than limit */
+static __inline unsigned int match_length(const unsigned char *a, const unsigned char *b, unsigned int limit)
+{
+    unsigned int len = 0;
+    uint64_t diff;
+
+#if defined(__AVX2__)
+    while (len + 32 <= limit)
     {
-        br->match_jump_next_table[chain_idx] = NULL;
-        br->match_jump_prev_table[chain_idx] = NULL;
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)(a + len)),
+                    _mm256_loadu_si256((const __m256i *)(b + len))));
+        if (mask != 0xFFFFFFFFU) return len + count_trailing_zeros((uint64_t)~mask);
+        len += 32;
     }
 #endif
-    /* Allocate space for 3 tables */
-    br->first_table = (int *)malloc(sizeof(int) * (ULZ77_HASH_SIZE));
-    if (br->first_table == NULL) goto fail;
-    br->final_table = (int *)malloc(sizeof(int) * (ULZ77_HASH_SIZE));
-    if (br->final_table == NULL) goto fail;
-    br->hash_jump_next_table = (int *)malloc(sizeof(int) * size);
-    if (br->hash_jump_next_table == NULL) goto fail;
-    br->hash_jump_prev_table = (int *)malloc(sizeof(int) * size);
-    if (br->hash_jump_prev_table == NULL) goto fail;
-#if defined(USE_MATCH_CHAIN)
-    for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
-    {
-        br->match_jump_next_table[chain_idx] = (int *)malloc(sizeof(int) * size);
-        if (br->match_jump_next_table[chain_idx] == NULL) goto fail;
-        br->match_jump_prev_table[chain_idx] = (int *)malloc(sizeof(int) * size);
-        if (br->match_jump_prev_table[chain_idx] == NULL) goto fail;
+#if defined(__SSE2__) || defined(_M_X64)
+    while (len + 16 <= limit)
+    {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(a + len)),
+                    _mm_loadu_si128((const __m128i *)(b + len))));
+        if (mask != 0xFFFFU) return len + count_trailing_zeros((uint64_t)(~mask & 0xFFFFU));
+        len += 16;
     }
 #endif
-    br->offset_table = (int *)malloc(sizeof(int) * size);
-    if (br->offset_table == NULL) goto fail;
-    for (i = 0; i < (ULZ77_HASH_SIZE); i++)
+    while (len + 8 <= limit)
+    {
+        diff = read_u64(a + len) ^ read_u64(b + len);
+        if (diff != 0) return len + count_equal_bytes(diff);
+        len += 8;
+    }
+    while ((len < limit) && (a[len] == b[len]))
+    {
+        len++;
+    }
+    return len;
+}
+
+/* Write a varint */
+static __inline unsigned char *write_varint(unsigned char *dst_p, uint64_t value)
+{
+    while (value >= 0x80)
     {
-        br->first_table[i] = NO_WHERE;
-        br->final_table[i] = NO_WHERE;
+        *dst_p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
     }
-    for (i = 0; i < size; i++)
+    *dst_p++ = (unsigned char)value;
+    return dst_p;
+}
+
+/* Read a varint of no more than (max_bytes) bytes,
+ * return NULL if it is truncated or too long */
+static __inline const unsigned char *read_varint(const unsigned char *src_p, const unsigned char *src_endp, unsigned int max_bytes, uint64_t *value)
+{
+    unsigned int shift = 0;
+    uint64_t result = 0;
+
+    while ((src_p != src_endp) && (max_bytes-- != 0))
     {
-        br->hash_jump_next_table[i] = NO_WHERE;
-        br->hash_jump_prev_table[i] = NO_WHERE;
-#if defined(USE_MATCH_CHAIN)
-        for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
+        result |= (uint64_t)(*src_p & 0x7F) << shift;
+        if ((*src_p++ & 0x80) == 0)
         {
-            br->match_jump_next_table[chain_idx][i] = NO_WHERE;
-            br->match_jump_prev_table[chain_idx][i] = NO_WHERE;
+            *value = result;
+            return src_p;
         }
-#endif
-        br->offset_table[i] = 0;
+        shift += 7;
     }
-    for (i = 0; i < ULZ77_RECENT_POS_SIZE; i++)
+    return NULL;
+}
+
+/* Bytes of a varint */
+static __inline unsigned int varint_size(uint64_t value)
+{
+    unsigned int size = 1;
+    while (value >= 0x80)
     {
-        br->recent_pos[i] = 0;
-    }
-    return 0;
-fail:
-    if (br->buf) free(br->buf);
-    if (br->first_table) free(br->first_table);
-    if (br->final_table) free(br->final_table);
-    if (br->hash_jump_next_table) free(br->hash_jump_next_table);
-    if (br->hash_jump_prev_table) free(br->hash_jump_prev_table);
-#if defined(USE_MATCH_CHAIN)
-    for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
-    {
-        if (br->match_jump_next_table[chain_idx] != NULL) 
-            free(br->match_jump_next_table[chain_idx]);
-        if (br->match_jump_prev_table[chain_idx] != NULL) 
-            free(br->match_jump_prev_table[chain_idx]);
+        value >>= 7;
+        size++;
     }
-#endif
-    if (br->offset_table) free(br->offset_table);
-    return -1;
+    return size;
 }
 
-/* Get the data in ring buffer with specified relative offset */
-static __inline unsigned char buffer_ring_get_from_relative(struct buffer_ring *br, int idx)
+/* Write a match token of format v2 */
+static __inline unsigned char *write_match(unsigned char *dst_p, unsigned int distance, unsigned int len)
 {
-    return br->buf[BUFCVT_FROM_RELATIVE(idx, br)];
+    unsigned int offset = distance - 1;
+
+    *dst_p++ = SENTINEL;
+    *dst_p++ = (unsigned char)((MIN(len - 3, 15) << 4) | ((offset >= 8) ? 0x8 : 0) | (offset & 0x7));
+    if (offset >= 8) dst_p = write_varint(dst_p, offset >> 3);
+    if (len >= 18) dst_p = write_varint(dst_p, len - 18);
+    return dst_p;
 }
 
-/* Get the data in ring buffer with specified slot */
-/*
-static __inline unsigned char buffer_ring_get_from_slot(struct buffer_ring *br, int slot)
+/* Write a literal of format v2 */
+static __inline unsigned char *write_literal(unsigned char *dst_p, unsigned char symbol)
 {
-    return buffer_ring_get_from_relative(br, ABSOLUTE_TO_RELATIVE(br->offset_table[slot], br));
+    *dst_p++ = symbol;
+    if (symbol == SENTINEL) *dst_p++ = 0;
+    return dst_p;
 }
-*/
 
+/* Write a sequence, a distance of 0 means literals only, 
+ * and 'last' omits the distance of it */
+static __inline unsigned char *write_sequence(unsigned char *dst_p, \
+        const unsigned char *literal_p, size_t literal_len, \
+        unsigned int distance, unsigned int len, int last)
+{
+    unsigned int match_bits = (distance != 0) ? MIN(len - MATCH_LEN_MIN, 15) : 0;
+
+    *dst_p++ = (unsigned char)((MIN(literal_len, 15) << 4) | match_bits);
+    if (literal_len >= 15) dst_p = write_varint(dst_p, literal_len - 15);
+    if (literal_len != 0) memcpy(dst_p, literal_p, literal_len);
+    dst_p += literal_len;
+    if (last) return dst_p;
+    dst_p = write_varint(dst_p, distance);
+    if (match_bits == 15) dst_p = write_varint(dst_p, len - MATCH_LEN_MIN - 15);
+    return dst_p;
+}
 
-/* Append symbol to the tail of ring buffer */
-static int buffer_ring_append(struct buffer_ring *br, unsigned char symbol)
+/* Tokens of a block being written */
+struct token_writer
 {
-#if defined(USE_MATCH_CHAIN)
-    int chain_idx;
-#endif
-    int i, j;
-    unsigned int hash_value;
-    int hash_literal_idx;
-    int next_pos;
+    unsigned char *dst_p;
+    unsigned char *dst_endp;
+    int sequence; /* write sequences rather than tokens */
+    const unsigned char *literal_p; /* literals not written yet (sequence), NULL if none */
+};
 
-    /* Oldest symbol will be erased, so update its first_table value via jump table */
-    if (br->second_pass)
-    {
-        hash_value = 0;
-        hash_literal_idx = ULZ77_HASH_LITERAL_SIZE;
-        while (hash_literal_idx > 0)
-        {
-            hash_value = (hash_value << 8) | buffer_ring_get_from_relative(br, ULZ77_HASH_LITERAL_SIZE - hash_literal_idx);
-            hash_literal_idx--;
-        }
-        hash_value &= ULZ77_HASH_MASK;
-        next_pos = br->hash_jump_next_table[BUFCVT_FROM_RELATIVE(0, br)];
-        if (next_pos != NO_WHERE)
-        {
-            br->hash_jump_prev_table[next_pos] = NO_WHERE;
-            br->first_table[hash_value] = next_pos;
-        }
-        else
-        {
-            br->first_table[hash_value] = NO_WHERE;
-            br->final_table[hash_value] = NO_WHERE;
-        }
-    }
+/* Bytes of a literal */
+static __inline unsigned int writer_literal_cost(const struct token_writer *w, unsigned char symbol)
+{
+    return ((symbol == SENTINEL) && (!w->sequence)) ? 2 : 1;
+}
 
-    /* Append symbol into ring */
-    br->buf[br->pos] = symbol;
-    br->hash_jump_next_table[br->pos] = NO_WHERE; /* The symbol is new (and the last one) here, so no one is in my next */
+/* Bytes of a match */
+static __inline unsigned int writer_match_cost(const struct token_writer *w, unsigned int distance, unsigned int len)
+{
+    unsigned int offset = distance - 1;
+
+    if (w->sequence)
+        return 1 + varint_size(distance) + ((len - MATCH_LEN_MIN >= 15) ? varint_size(len - MATCH_LEN_MIN - 15) : 0);
+    return 2 + ((offset >= 8) ? varint_size(offset >> 3) : 0) + ((len >= 18) ? varint_size(len - 18) : 0);
+}
+
+/* Bytes could be taken by the following tokens, the literals not
+ * written yet and the reserved size are excluded */
+static __inline size_t writer_room(const struct token_writer *w, const unsigned char *src_p)
+{
+    size_t room = (size_t)(w->dst_endp - w->dst_p);
+    size_t used = ULZ77_BUFFER_RESERVED_SIZE;
+
+    if (w->sequence)
+        used = SEQUENCE_RESERVED_SIZE + ((w->literal_p != NULL) ? (size_t)(src_p - w->literal_p) : 0);
+    return (room > used) ? (room - used) : 0;
+}
 
-#if defined(USE_MATCH_CHAIN)
-    for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
+/* Take the byte at src_p as a literal */
+static __inline void writer_literal(struct token_writer *w, const unsigned char *src_p)
+{
+    if (w->sequence)
     {
-        br->match_jump_next_table[chain_idx][br->pos] = NO_WHERE;
-        br->match_jump_prev_table[chain_idx][br->pos] = NO_WHERE;
+        if (w->literal_p == NULL) w->literal_p = src_p;
+        return;
     }
-#endif
+    w->dst_p = write_literal(w->dst_p, *src_p);
+}
 
-    br->offset_table[br->pos] = br->absolute_pos; /* The symbol is new (and the last one) here, so no one is in my next */
+/* Take the bytes at src_p as a match */
+static __inline void writer_match(struct token_writer *w, const unsigned char *src_p, unsigned int distance, unsigned int len)
+{
+    if (w->sequence)
+    {
+        w->dst_p = (w->literal_p != NULL) ? \
+                   write_sequence(w->dst_p, w->literal_p, (size_t)(src_p - w->literal_p), distance, len, 0) : \
+                   write_sequence(w->dst_p, NULL, 0, distance, len, 0);
+        w->literal_p = NULL;
+        return;
+    }
+    w->dst_p = write_match(w->dst_p, distance, len);
+}
 
-    i = ULZ77_RECENT_POS_SIZE - 1;
-    j = ULZ77_RECENT_POS_SIZE - 2;
-    while (j >= 0)
+/* Write the literals before src_p which are not written yet */
+static __inline void writer_flush(struct token_writer *w, const unsigned char *src_p, int last)
+{
+    if (w->literal_p != NULL)
     {
-        br->recent_pos[i] = br->recent_pos[j];
-        i--;j--;
+        w->dst_p = write_sequence(w->dst_p, w->literal_p, (size_t)(src_p - w->literal_p), 0, 0, last);
+        w->literal_p = NULL;
     }
-    br->recent_pos[0] = br->pos;
+}
 
-    br->pos++;
-    if (br->pos > br->grow) br->grow = br->pos;
+/* Write header of format v2, return the bytes written */
+static size_t write_header(unsigned char *dst, unsigned int window_log, unsigned int flags, uint64_t content_size, uint32_t dict_id)
+{
+    unsigned char *dst_p = dst;
 
-    /* jump to head and mark second pass */
-    if (br->pos >= br->size)
+    memcpy(dst_p, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    dst_p += HEADER_MAGIC_SIZE;
+    *dst_p++ = SENTINEL;
+    *dst_p++ = ULZ77_FORMAT_V2;
+    *dst_p++ = (unsigned char)window_log;
+    *dst_p++ = (unsigned char)flags;
+    dst_p = write_varint(dst_p, content_size);
+    if ((flags & ULZ77_FLAG_DICT) != 0)
     {
-        br->pos = 0;
-        br->second_pass = 1;
+        *dst_p++ = (unsigned char)dict_id;
+        *dst_p++ = (unsigned char)(dict_id >> 8);
+        *dst_p++ = (unsigned char)(dict_id >> 16);
+        *dst_p++ = (unsigned char)(dict_id >> 24);
     }
 
-    /* update absolute position */
-    br->absolute_pos++;
+    return (size_t)(dst_p - dst);
+}
 
-    return 0;
+/* Index block of seekable stream */
+static __inline int is_index_block(const unsigned char *src, size_t len)
+{
+    return (len >= HEADER_MAGIC_SIZE + 2) && (memcmp(src, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0) && \
+            (src[3] == SENTINEL) && (src[4] == INDEX_VERSION);
 }
 
-static int buffer_ring_update_tables(struct buffer_ring *br, unsigned int hash_value, unsigned int relative_pos)
+/* Parse header, data without the header of format v2 is taken as v1.
+ * return 0 if succeed, or -ULZ77_ERR_INVALID_DATA if the header is
+ * broken or unsupported */
+static int parse_header(const unsigned char *src, size_t len, struct ulz77_header *header)
 {
-#if defined(USE_MATCH_CHAIN)
-    int least_match_final_pos, least_match_cur_pos;
-    int chain_upgrade = -1;
-    int recent_pos_slot;
-    int i;
-#endif
-    if (br->first_table[hash_value] == NO_WHERE)
+    const unsigned char *src_p;
+
+    if ((len < HEADER_FIXED_SIZE + 1) || (memcmp(src, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0) || \
+            (src[3] != SENTINEL) || ((src[4] >> 4) != 0) || (src[4] == 0))
     {
-        /* this is the first time it came into ring buffer */
-        br->first_table[hash_value] = relative_pos;
-        br->final_table[hash_value] = relative_pos;
+        header->format = ULZ77_FORMAT_V1;
+        header->window_log = 12;
+        header->flags = 0;
+        header->content_size = 0;
+        header->dict_id = 0;
+        header->header_len = 0;
+        return 0;
     }
-    else
-    {
-        /* it is already exists in ring buffer */
-        /* connect the existent final one to this one */
-        br->hash_jump_next_table[br->final_table[hash_value]] = relative_pos;
-        br->hash_jump_prev_table[relative_pos] = br->final_table[hash_value];
 
-        /* this one is now the new final one */
-        br->final_table[hash_value] = relative_pos;
+    header->format = src[4];
+    header->window_log = src[5];
+    header->flags = src[6];
+    if ((header->format != ULZ77_FORMAT_V2) || \
+            (header->window_log < ULZ77_WINDOW_LOG_MIN) || (header->window_log > ULZ77_WINDOW_LOG_MAX) || \
+            ((header->flags & ~HEADER_FLAGS_SUPPORTED) != 0))
+    {
+        return -ULZ77_ERR_INVALID_DATA;
+    }
+    src_p = read_varint(src + HEADER_FIXED_SIZE, src + len, 10, &header->content_size);
+    if (src_p == NULL) return -ULZ77_ERR_INVALID_DATA;
+    header->dict_id = 0;
+    if ((header->flags & ULZ77_FLAG_DICT) != 0)
+    {
+        if (src + len - src_p < 4) return -ULZ77_ERR_INVALID_DATA;
+        header->dict_id = (uint32_t)src_p[0] | ((uint32_t)src_p[1] << 8) | \
+                ((uint32_t)src_p[2] << 16) | ((uint32_t)src_p[3] << 24);
+        src_p += 4;
     }
+    header->header_len = (size_t)(src_p - src);
+
+    return 0;
+}
+
+/* Sequences of entropy coded blocks never take more than this size */
+static __inline size_t entropy_sequences_bound(uint64_t content_size)
+{
+    return (size_t)content_size * 2 + SEQUENCE_RESERVED_SIZE * 4;
+}
+
+/* Build code lengths no longer than HUFFMAN_LEN_MAX for the symbols of
+ * nonzero frequency, there are 2 of them at least */
+static void huffman_build_lengths(const uint32_t *freq, unsigned char *lengths)
+{
+    unsigned int symbols[LITERAL_SIZE];
+    uint64_t weight[LITERAL_SIZE * 2];
+    unsigned int parent[LITERAL_SIZE * 2];
+    unsigned int depth[LITERAL_SIZE * 2];
+    unsigned int num_codes[LITERAL_SIZE + 1];
+    unsigned int n = 0, i, j, k, leaf, node, child, len;
+    uint32_t total;
 
-    /* update least table */
-#if defined(USE_MATCH_CHAIN)
-    if (br->absolute_pos < RECENT_POS_SIZE)
+    /* symbols in ascending order of frequency */
+    for (i = 0; i < LITERAL_SIZE; i++)
     {
-        return 0;
+        lengths[i] = 0;
+        if (freq[i] == 0) continue;
+        for (j = n; (j > 0) && (freq[symbols[j - 1]] > freq[i]); j--) symbols[j] = symbols[j - 1];
+        symbols[j] = i;
+        n++;
     }
-    least_match_final_pos = ABSOLUTE_TO_RELATIVE(br->offset_table[br->recent_pos[RECENT_POS_SIZE - 1]], br);
-    least_match_cur_pos = br->hash_jump_prev_table[least_match_final_pos];
-    while (least_match_cur_pos != NO_WHERE)
+
+    /* Huffman tree with 2 queues, the leaves and the nodes in the order
+     * of creation which is also the order of weight */
+    for (i = 0; i < n; i++) weight[i] = freq[symbols[i]];
+    leaf = 0;
+    node = n;
+    for (k = n; k < n * 2 - 1; k++)
     {
-        if (buffer_ring_get_from_relative(br, ABSOLUTE_TO_RELATIVE(br->offset_table[least_match_cur_pos], br)) ==\
-                buffer_ring_get_from_relative(br, ABSOLUTE_TO_RELATIVE(br->offset_table[least_match_final_pos], br)))
-        {
-            /* 3 chars matched */
-            chain_upgrade = 0;
-            br->match_jump_next_table[0][least_match_cur_pos] = least_match_final_pos;
-            br->match_jump_prev_table[0][least_match_final_pos] = least_match_cur_pos;
-            break;
-        }
-        else
+        weight[k] = 0;
+        for (j = 0; j < 2; j++)
         {
-            least_match_cur_pos = br->hash_jump_prev_table[least_match_cur_pos];
+            if ((leaf < n) && ((node == k) || (weight[leaf] <= weight[node])))
+                child = leaf++;
+            else
+                child = node++;
+            parent[child] = k;
+            weight[k] += weight[child];
         }
     }
-    if (chain_upgrade == -1) return 0; /* matched not found */
+    depth[n * 2 - 2] = 0;
+    for (k = n * 2 - 2; k-- > 0; ) depth[k] = depth[parent[k]] + 1;
 
-    /* try 4 and more bytes */
-    for (i = 1; i < MATCH_CHAIN_SIZE; i++)
+    /* limit the lengths, then fix the codes space by splitting the
+     * shorter codes */
+    memset(num_codes, 0, sizeof(num_codes));
+    for (i = 0; i < n; i++) num_codes[MIN(depth[i], HUFFMAN_LEN_MAX)]++;
+    total = 0;
+    for (len = 1; len <= HUFFMAN_LEN_MAX; len++) total += num_codes[len] << (HUFFMAN_LEN_MAX - len);
+    while (total > (1U << HUFFMAN_LEN_MAX))
     {
-        /* try to link in chain 'i', so search gateway of chain 'i' in chain 'i-1' */
-        recent_pos_slot = RECENT_POS_SIZE - 1 - 2 - i;
-        least_match_final_pos = ABSOLUTE_TO_RELATIVE(br->offset_table[br->recent_pos[RECENT_POS_SIZE - 1]], br);
-        least_match_cur_pos = br->match_jump_prev_table[chain_upgrade][least_match_final_pos];
-        while (least_match_cur_pos != NO_WHERE)
+        num_codes[HUFFMAN_LEN_MAX]--;
+        for (len = HUFFMAN_LEN_MAX - 1; len > 0; len--)
         {
-            if (buffer_ring_get_from_relative(br, br->recent_pos[recent_pos_slot]) ==\
-                    buffer_ring_get_from_relative(br, ABSOLUTE_TO_RELATIVE(br->offset_table[least_match_cur_pos] + 2 + i, br)))
+            if (num_codes[len] != 0)
             {
-                chain_upgrade = i;
-                br->match_jump_next_table[chain_upgrade][least_match_cur_pos] = least_match_final_pos;
-                br->match_jump_prev_table[chain_upgrade][least_match_final_pos] = least_match_cur_pos;
+                num_codes[len]--;
+                num_codes[len + 1] += 2;
                 break;
             }
-            else
-            {
-                least_match_cur_pos = br->match_jump_prev_table[chain_upgrade][least_match_cur_pos];
-            }
         }
-        if (least_match_cur_pos == NO_WHERE) return 0; /* matched not found */
+        total--;
     }
-#endif
 
+    /* the shorter codes for the more frequent symbols */
+    i = n;
+    for (len = 1; len <= HUFFMAN_LEN_MAX; len++)
+    {
+        for (k = num_codes[len]; k > 0; k--) lengths[symbols[--i]] = (unsigned char)len;
+    }
+}
+
+/* Assign canonical codes, bits reversed to be read from the lowest bit,
+ * return 0 if the code lengths are valid */
+static int huffman_build_codes(const unsigned char *lengths, uint16_t *codes)
+{
+    unsigned int bl_count[HUFFMAN_LEN_MAX + 1];
+    unsigned int next_code[HUFFMAN_LEN_MAX + 1];
+    unsigned int i, len, code, reversed;
+    uint32_t total = 0;
+
+    memset(bl_count, 0, sizeof(bl_count));
+    for (i = 0; i < LITERAL_SIZE; i++)
+    {
+        if (lengths[i] > HUFFMAN_LEN_MAX) return -ULZ77_ERR_INVALID_DATA;
+        bl_count[lengths[i]]++;
+    }
+    bl_count[0] = 0;
+    code = 0;
+    for (len = 1; len <= HUFFMAN_LEN_MAX; len++)
+    {
+        code = (code + bl_count[len - 1]) << 1;
+        next_code[len] = code;
+        total += bl_count[len] << (HUFFMAN_LEN_MAX - len);
+    }
+    if (total > (1U << HUFFMAN_LEN_MAX)) return -ULZ77_ERR_INVALID_DATA;
+
+    for (i = 0; i < LITERAL_SIZE; i++)
+    {
+        len = lengths[i];
+        if (len == 0) continue;
+        code = next_code[len]++;
+        for (reversed = 0; len > 0; len--, code >>= 1) reversed = (reversed << 1) | (code & 1);
+        codes[i] = (uint16_t)reversed;
+    }
     return 0;
 }
 
-/* return the relative position of founded object */
-static int buffer_ring_find(struct buffer_ring *br, /* buffer ring */
-        unsigned int hash_value, unsigned char *pat, unsigned char *pat_endp, /* arguments */
-        unsigned int *ret_pos, unsigned int *ret_len) /* return values */
+/* Write a stream in the cheapest mode */
+static unsigned char *write_stream(unsigned char *dst_p, const unsigned char *src, size_t len)
 {
-#if defined(USE_MATCH_CHAIN)
-    int chain = -1; /* chain using, -1 for hash chain, 0..9 for match chain */
-    int chain_save = -1;
-#endif
-    int next_point;
-    int i; /* jump table slot idx */
-    int ret_jump_table_slot;
-    int j; /* relative offset */
-    ret_jump_table_slot = 0;
-    *ret_pos = 0;
-    *ret_len = 0;
-    if (br->grow == 0) return 0;
-    /* locate first char pos */
-    if (br->first_table[hash_value] == NO_WHERE) return 0; /* not found */
-    else i = br->first_table[hash_value]; /* found */
-
-    for (;;) {
-        unsigned char *pat_p = pat;
-        unsigned int matched_len;
-        matched_len = 0;
-        j = br->offset_table[i];
-        j = ABSOLUTE_TO_RELATIVE(j, br);
+    uint32_t freq[LITERAL_SIZE];
+    unsigned char lengths[LITERAL_SIZE];
+    uint16_t codes[LITERAL_SIZE];
+    unsigned int used = 0, count = 0, i;
+    uint64_t bits = 0, coded_bits = 0;
+    size_t coded_size, n;
 
-        while (((unsigned int)j < br->grow) && expect((pat_p != pat_endp), 1) &&\
-                (br->buf[BUFCVT_FROM_RELATIVE(j, br)] == *pat_p))
-        {
-            matched_len++;
-            pat_p++;
-            j++;
-        }
-        if ((matched_len > *ret_len))
-        {
-            ret_jump_table_slot = i;
-            *ret_len = matched_len;
-        }
-#if defined(USE_MATCH_CHAIN)
-        if (matched_len >= 3)
-        {
-            chain_save = chain;
-            chain = MIN(matched_len - 3, MATCH_CHAIN_SIZE - 1);
-        }
-        if (chain != -1)
+    memset(freq, 0, sizeof(freq));
+    for (n = 0; n < len; n++) freq[src[n]]++;
+    for (i = 0; i < LITERAL_SIZE; i++) if (freq[i] != 0) used++;
+
+    if (used == 1)
+    {
+        *dst_p++ = STREAM_MODE_REPEAT;
+        dst_p = write_varint(dst_p, len);
+        *dst_p++ = src[0];
+        return dst_p;
+    }
+    if (used > 1)
+    {
+        huffman_build_lengths(freq, lengths);
+        for (i = 0; i < LITERAL_SIZE; i++) coded_bits += (uint64_t)freq[i] * lengths[i];
+        coded_size = (size_t)((coded_bits + 7) / 8);
+        if (HUFFMAN_LENGTHS_SIZE + varint_size(coded_size) + coded_size < len)
         {
-            next_point = br->match_jump_next_table[chain][i];
-            if (next_point == NO_WHERE)
+            *dst_p++ = STREAM_MODE_HUFFMAN;
+            dst_p = write_varint(dst_p, len);
+            for (i = 0; i < LITERAL_SIZE; i += 2) *dst_p++ = (unsigned char)(lengths[i] | (lengths[i + 1] << 4));
+            dst_p = write_varint(dst_p, coded_size);
+
+            huffman_build_codes(lengths, codes);
+            for (n = 0; n < len; n++)
             {
-                chain = chain_save;
-                next_point = br->hash_jump_next_table[i];
+                bits |= (uint64_t)codes[src[n]] << count;
+                count += lengths[src[n]];
+                while (count >= 8)
+                {
+                    *dst_p++ = (unsigned char)bits;
+                    bits >>= 8;
+                    count -= 8;
+                }
             }
+            if (count != 0) *dst_p++ = (unsigned char)bits;
+            return dst_p;
         }
-        else
+    }
+
+    *dst_p++ = STREAM_MODE_RAW;
+    dst_p = write_varint(dst_p, len);
+    memcpy(dst_p, src, len);
+    return dst_p + len;
+}
+
+/* Split sequences into streams of tokens, literals and varints, then
+ * write them, return NULL if the sequences are broken */
+static unsigned char *write_entropy(unsigned char *dst_p, const unsigned char *seq, size_t seq_len, unsigned char *streams)
+{
+    const unsigned char *seq_p = seq, *seq_endp = seq + seq_len, *varint_p;
+    unsigned char *token_p = streams, *literal_p = streams + seq_len, *extra_p = streams + seq_len * 2;
+    uint64_t literal_len, distance;
+    unsigned int token;
+
+    while (seq_p != seq_endp)
+    {
+        token = *token_p++ = *seq_p++;
+        literal_len = token >> 4;
+        if (literal_len == 15)
         {
-            next_point = br->hash_jump_next_table[i];
+            varint_p = seq_p;
+            if ((seq_p = read_varint(seq_p, seq_endp, 10, &literal_len)) == NULL) return NULL;
+            memcpy(extra_p, varint_p, (size_t)(seq_p - varint_p));
+            extra_p += seq_p - varint_p;
+            literal_len += 15;
         }
-#else
-        next_point = br->hash_jump_next_table[i];
-#endif
-        if (next_point == NO_WHERE) break;
-        else
+        memcpy(literal_p, seq_p, (size_t)literal_len);
+        literal_p += literal_len;
+        seq_p += literal_len;
+        if (seq_p == seq_endp) break;
+
+        varint_p = seq_p;
+        if ((seq_p = read_varint(seq_p, seq_endp, 4, &distance)) == NULL) return NULL;
+        if ((distance != 0) && ((token & 0xF) == 15))
         {
-            i = next_point;
+            if ((seq_p = read_varint(seq_p, seq_endp, 3, &literal_len)) == NULL) return NULL;
         }
+        memcpy(extra_p, varint_p, (size_t)(seq_p - varint_p));
+        extra_p += seq_p - varint_p;
     }
-    *ret_pos = ABSOLUTE_TO_RELATIVE(br->offset_table[ret_jump_table_slot], br); /* return relative position ? */
-    return 0;
+
+    dst_p = write_stream(dst_p, streams, (size_t)(token_p - streams));
+    dst_p = write_stream(dst_p, streams + seq_len, (size_t)(literal_p - (streams + seq_len)));
+    dst_p = write_stream(dst_p, streams + seq_len * 2, (size_t)(extra_p - (streams + seq_len * 2)));
+    return dst_p;
 }
 
-int buffer_ring_uninit(struct buffer_ring *br)
+/* Read the header of a stream, return the position after the stream or
+ * NULL if it is broken */
+static const unsigned char *read_stream(const unsigned char *src_p, const unsigned char *src_endp, struct entropy_stream *stream)
 {
-#if defined(USE_MATCH_CHAIN)
-    unsigned int chain_idx;
-#endif
-    if (br->buf) free(br->buf);
-    if (br->first_table) free(br->first_table);
-    if (br->final_table) free(br->final_table);
-    if (br->hash_jump_next_table) free(br->hash_jump_next_table);
-    if (br->hash_jump_prev_table) free(br->hash_jump_prev_table);
-#if defined(USE_MATCH_CHAIN)
-    for (chain_idx = 0; chain_idx < MATCH_CHAIN_SIZE; chain_idx++)
+    uint64_t value;
+
+    if (src_p == src_endp) return NULL;
+    stream->mode = *src_p++;
+    if ((src_p = read_varint(src_p, src_endp, 10, &value)) == NULL) return NULL;
+    stream->raw_size = (size_t)value;
+    if ((uint64_t)stream->raw_size != value) return NULL;
+
+    switch (stream->mode)
     {
-        if (br->match_jump_next_table[chain_idx] != NULL) free(br->match_jump_next_table[chain_idx]);
-        if (br->match_jump_prev_table[chain_idx] != NULL) free(br->match_jump_prev_table[chain_idx]);
+        case STREAM_MODE_RAW:
+            stream->data_len = stream->raw_size;
+            break;
+        case STREAM_MODE_HUFFMAN:
+            if ((size_t)(src_endp - src_p) < HUFFMAN_LENGTHS_SIZE) return NULL;
+            stream->lengths = src_p;
+            src_p += HUFFMAN_LENGTHS_SIZE;
+            if ((src_p = read_varint(src_p, src_endp, 10, &value)) == NULL) return NULL;
+            stream->data_len = (size_t)value;
+            if ((uint64_t)stream->data_len != value) return NULL;
+            break;
+        case STREAM_MODE_REPEAT:
+            stream->data_len = 1;
+            break;
+        default:
+            return NULL;
     }
-#endif
-    if (br->offset_table) free(br->offset_table);
-    return 0;
+    if ((size_t)(src_endp - src_p) < stream->data_len) return NULL;
+    stream->data = src_p;
+    return src_p + stream->data_len;
 }
 
-/* Create new encoder */
-struct ulz77_encoder *ulz77_encoder_new(void)
+/* Decode a stream into dst of its raw size */
+static int decode_stream(const struct entropy_stream *stream, unsigned char *dst)
 {
-    struct ulz77_encoder *enc;
+    unsigned char lengths[LITERAL_SIZE];
+    uint16_t codes[LITERAL_SIZE];
+    uint16_t table[HUFFMAN_TABLE_SIZE]; /* symbol << 4 | code length */
+    const unsigned char *src_p, *src_endp;
+    uint64_t bits = 0;
+    unsigned int count = 0, i, j, entry;
+    size_t n;
 
-    enc = (struct ulz77_encoder *)malloc(sizeof(struct ulz77_encoder));
-    if (enc == NULL) return NULL;
-    if (buffer_ring_init(&enc->br, BUFFER_SIZE) != 0)
+    switch (stream->mode)
     {
-        free(enc);
-        return NULL;
+        case STREAM_MODE_RAW:
+            memcpy(dst, stream->data, stream->raw_size);
+            return 0;
+        case STREAM_MODE_REPEAT:
+            memset(dst, stream->data[0], stream->raw_size);
+            return 0;
+        default:
+            break;
     }
-    enc->future_bytes = 0;
-    enc->src_p_interrupted = NULL;
-    enc->src_len = 0;
-    enc->dst_len = 0;
-    enc->src_total_len = 0;
-    enc->dst_total_len = 0;
 
-    return enc;
-}
+    /* table of every HUFFMAN_LEN_MAX bits, unused codes are left 0 */
+    for (i = 0; i < LITERAL_SIZE; i += 2)
+    {
+        lengths[i] = stream->lengths[i / 2] & 0xF;
+        lengths[i + 1] = stream->lengths[i / 2] >> 4;
+    }
+    if (huffman_build_codes(lengths, codes) != 0) return -ULZ77_ERR_INVALID_DATA;
+    memset(table, 0, sizeof(table));
+    for (i = 0; i < LITERAL_SIZE; i++)
+    {
+        if (lengths[i] == 0) continue;
+        for (j = codes[i]; j < HUFFMAN_TABLE_SIZE; j += 1U << lengths[i])
+            table[j] = (uint16_t)((i << 4) | lengths[i]);
+    }
 
-/* Destroy encoder */
-int ulz77_encoder_destroy(struct ulz77_encoder *enc)
-{
-    buffer_ring_uninit(&enc->br);
-    free(enc);
+    src_p = stream->data;
+    src_endp = stream->data + stream->data_len;
+    for (n = 0; n < stream->raw_size; n++)
+    {
+        while ((count <= 56) && (src_p != src_endp))
+        {
+            bits |= (uint64_t)*src_p++ << count;
+            count += 8;
+        }
+        entry = table[bits & (HUFFMAN_TABLE_SIZE - 1)];
+        if (((entry & 0xF) == 0) || ((entry & 0xF) > count)) return -ULZ77_ERR_INVALID_DATA;
+        dst[n] = (unsigned char)(entry >> 4);
+        bits >>= entry & 0xF;
+        count -= entry & 0xF;
+    }
     return 0;
 }
 
-/* Encode data */
-int ulz77_encoder_encode(struct ulz77_encoder *enc, \
-        unsigned char *dst, size_t dst_buffer_size, \
-        unsigned char *src, size_t len)
+/* Bytes of ring body and tables in a workspace */
+static __inline size_t buffer_ring_workspace_size(unsigned int size)
 {
-    int ret = 0;
-    unsigned char *dst_p = dst; /* reserve 4 bytes for block size */
-    unsigned int dst_count = 0;
-    unsigned int future_bytes = enc->future_bytes;
-    unsigned char *src_p = src, *src_endp;
-    unsigned int matched_pos, matched_len, matched_len_sub;
-    unsigned int i;
+    return sizeof(unsigned char) * size * 2 + sizeof(uint32_t) * (ULZ77_HASH_SIZE + size);
+}
 
-    /* push the first 3 bytes */
-    if (enc->src_p_interrupted == NULL)
+/* initialize ring buffer data structure, the body and tables are carved
+ * out of mem if it is not NULL */
+static int buffer_ring_init(struct buffer_ring *br, unsigned int size, unsigned char *mem)
+{
+    /* Clean pointers */
+    br->buf = NULL;
+    br->head_table = br->chain_table = NULL;
+    br->dict = NULL;
+    /* Basic settings */
+    br->grow = 0;
+    br->size = size;
+    br->absolute_pos = size;
+    if (mem != NULL)
     {
-        src_endp = src + MIN(len, 3);
-        if (len >= 2)
-        {
-            future_bytes = (*src_p << 8) | (*(src_p + 1));
-        }
-        while (src_p != src_endp)
-        {
-            if (len >= 3)
-            {
-                future_bytes = (future_bytes << 8) | *(src_p + 2);
-            }
-            buffer_ring_append(&enc->br, *src_p);
-            if (len >= 3)
-            {
-                buffer_ring_update_tables(&enc->br, ULZ77_HASH(future_bytes), enc->br.recent_pos[0]);
-            }
-            *dst_p++ = *src_p++;
-            dst_count++;
-        }
+        br->buf = mem;
+        br->head_table = (uint32_t *)(mem + size * 2);
+        br->chain_table = br->head_table + ULZ77_HASH_SIZE;
+        memset(br->head_table, 0, sizeof(uint32_t) * (ULZ77_HASH_SIZE + size));
+        return 0;
     }
+    /* Allocate body for ring, twice the size for the mirror */
+    br->buf = (unsigned char *)mem_alloc(sizeof(unsigned char) * size * 2);
+    if (br->buf == NULL) goto fail;
+    /* Allocate space for 2 tables, zeroed positions are out of window */
+    br->head_table = (uint32_t *)mem_calloc(ULZ77_HASH_SIZE, sizeof(uint32_t));
+    if (br->head_table == NULL) goto fail;
+    br->chain_table = (uint32_t *)mem_calloc(size, sizeof(uint32_t));
+    if (br->chain_table == NULL) goto fail;
+    return 0;
+fail:
+    if (br->buf) mem_free(br->buf);
+    if (br->head_table) mem_free(br->head_table);
+    if (br->chain_table) mem_free(br->chain_table);
+    return -1;
+}
 
-    /* position and length to be copy from the buffer */
-    if (len > 3 + 3)
-    {
-        src_endp = src + len - 3;
-        while (src_p != src_endp) 
-        {
+/* Shift every position in tables down to avoid overflow,
+ * positions which fall off the window become zero */
+static void buffer_ring_rebase(struct buffer_ring *br)
+{
+    /* keep the slot of every position in ring unchanged */
+    uint32_t delta = (br->absolute_pos - br->size) & ~(br->size - 1);
+    unsigned int i;
 
-            /* yield if buffer full */
-            if (dst_count >= dst_buffer_size - ULZ77_BUFFER_RESERVED_SIZE)
-            {
-                enc->src_p_interrupted = src_p;
-                enc->future_bytes = future_bytes;
-                enc->src_len = src_p - src;
-                enc->dst_len = dst_count;
-                enc->src_total_len += enc->src_len;
-                enc->dst_total_len += enc->dst_len;
-                return -ULZ77_ERR_BUFFER_FULL;
-            }
+    for (i = 0; i < ULZ77_HASH_SIZE; i++)
+        br->head_table[i] = (br->head_table[i] > delta) ? (br->head_table[i] - delta) : 0;
+    for (i = 0; i < br->size; i++)
+        br->chain_table[i] = (br->chain_table[i] > delta) ? (br->chain_table[i] - delta) : 0;
+    br->absolute_pos -= delta;
+}
 
-            /* find from history */
-            buffer_ring_find(&enc->br, ULZ77_HASH((future_bytes << 8) | *(src_p + 2)), src_p, src_endp, &matched_pos, &matched_len);
+/* Forget everything in the ring by moving the positions a ring size
+ * ahead, all the entries in tables become stale */
+static void buffer_ring_reset(struct buffer_ring *br)
+{
+    br->grow = 0;
+    br->absolute_pos += br->size;
+    if (expect(br->absolute_pos >= ABSOLUTE_POS_LIMIT, 0))
+        buffer_ring_rebase(br);
+}
 
-            /* repeat string in history ring? */
-            if (matched_len >= MATCH_LEN_MIN)
-            {
-                /* reference history */
+/* Append symbol to the tail of ring buffer */
+static __inline int buffer_ring_append(struct buffer_ring *br, unsigned char symbol)
+{
+    unsigned int slot = br->absolute_pos & (br->size - 1);
 
-                matched_len &= ((0x1 << 14) - 1);
+    /* Append symbol into ring and its mirror */
+    br->buf[slot] = symbol;
+    br->buf[slot + br->size] = symbol;
+    if (br->grow < br->size) br->grow++;
 
-                /* basic match part */
-                *dst_p++ = SENTINEL;
-                *dst_p++ = ((MIN(matched_len - 3, 15) & 0xF) << 4) | ((matched_pos >> 8) & 0xF);
-                *dst_p++ = matched_pos & 0xFF;
-                dst_count += 3;
-                /* extra bytes */
-                if (matched_len >= 18)
-                {
-                    matched_len_sub = matched_len - 17;
-                    while (matched_len_sub != 0)
-                    {
-                        *dst_p++ = (((matched_len_sub >> 7) != 0 ? 1 : 0) << 7) | (matched_len_sub & 127);
-                        dst_count++;
-                        matched_len_sub >>= 7;
-                    }
-                }
+    /* update absolute position */
+    br->absolute_pos++;
+    if (expect(br->absolute_pos >= ABSOLUTE_POS_LIMIT, 0))
+        buffer_ring_rebase(br);
 
-                /* add symbols into history buffer */
-                for (i = 0; i < matched_len; i++) {
-                    future_bytes = (future_bytes << 8) | *(src_p + i + 2);
-                    buffer_ring_append(&enc->br, *(src_p + i));
-                    buffer_ring_update_tables(&enc->br, ULZ77_HASH(future_bytes), enc->br.recent_pos[0]);
-                }
-                src_p += matched_len;
-            }
-            else
-            {
-                future_bytes = (future_bytes << 8) | *(src_p + 2);
-                buffer_ring_append(&enc->br, *src_p);
-                buffer_ring_update_tables(&enc->br, ULZ77_HASH(future_bytes), enc->br.recent_pos[0]);
-                if (*src_p == SENTINEL)
-                {
-                    *dst_p++ = SENTINEL;
-                    *dst_p++ = 0;
-                    *dst_p++ = 0;
-                    dst_count += 3;
-                }
-                else
-                {
-                    *dst_p++ = *src_p;
-                    dst_count++;
-                }
-                src_p++;
-            }
-        }
+    return 0;
+}
+
+/* Link the position into the chain of its hash value */
+static __inline void buffer_ring_insert(struct buffer_ring *br, unsigned int hash_value, uint32_t absolute_pos)
+{
+    br->chain_table[absolute_pos & (br->size - 1)] = br->head_table[hash_value];
+    br->head_table[hash_value] = absolute_pos;
+}
+
+/* Append symbols to the tail of ring buffer in bulk, 
+ * the first 'hashable' positions (which are followed by at least
+ * ULZ77_HASH_LITERAL_SIZE bytes in src) are linked into chains */
+static int buffer_ring_append_bulk(struct buffer_ring *br, const unsigned char *src, unsigned int len, unsigned int hashable)
+{
+    unsigned int i, n, slot, len_copy;
+    uint32_t absolute_pos = br->absolute_pos;
+
+    /* Link positions */
+    for (i = 0; i < hashable; i++)
+    {
+        buffer_ring_insert(br, ULZ77_HASH(read_u32(src + i)), absolute_pos + i);
     }
-    /* Normally encoded the middle part */
-    /* push the final 3 bytes */
-    src_endp = src + len;
-    ret = 0;
-    while (src_p != src_endp) 
+
+    /* Copy symbols into ring and its mirror, only the last (size) bytes survive */
+    if (len > br->size)
     {
-        if (*src_p == SENTINEL)
-        {
-            *dst_p++ = SENTINEL;
-            *dst_p++ = 0;
-            *dst_p++ = 0;
-            dst_count += 3;
-        }
-        else
-        {
-            *dst_p++ = *src_p;
-            dst_count++;
-        }
-        src_p++;
+        src += len - br->size;
+        absolute_pos += len - br->size;
+        len_copy = br->size;
     }
+    else
+    {
+        len_copy = len;
+    }
+    for (i = 0; i < len_copy; i += n)
+    {
+        slot = (absolute_pos + i) & (br->size - 1);
+        n = MIN(len_copy - i, br->size - slot);
+        memcpy(br->buf + slot, src + i, n);
+        memcpy(br->buf + slot + br->size, src + i, n);
+    }
+    br->grow = MIN(br->grow + len, br->size);
 
-    enc->src_p_interrupted = NULL;
-    enc->future_bytes = future_bytes;
-    enc->src_len = src_p - src;
-    enc->dst_len = dst_count;
-    enc->src_total_len += enc->src_len;
-    enc->dst_total_len += enc->dst_len;
+    /* update absolute position */
+    br->absolute_pos += len;
+    if (expect(br->absolute_pos >= ABSOLUTE_POS_LIMIT, 0))
+        buffer_ring_rebase(br);
 
-    return ret;
+    return 0;
 }
 
-unsigned char *ulz77_encoder_get_previous(struct ulz77_encoder *enc)
+/* return the distance of founded object */
+static int buffer_ring_find(struct buffer_ring *br, /* buffer ring */
+        const struct ulz77_level *level, /* searching parameters */
+        unsigned int hash_value, const unsigned char *pat, const unsigned char *pat_endp, /* arguments */
+        unsigned int *ret_distance, unsigned int *ret_len) /* return values */
 {
-    return enc->src_p_interrupted;
-}
+    uint32_t candidate; /* absolute position of candidate */
+    uint32_t distance;
+    unsigned int pat_len = (unsigned int)MIN(pat_endp - pat, MATCH_LEN_LIMIT);
+    unsigned int good_len; /* long enough to stop searching */
+    unsigned int depth; /* candidates visited */
+    *ret_distance = 0;
+    *ret_len = 0;
 
-/* Decode data */
-int ulz77_encoder_decode(struct ulz77_encoder *enc, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len)
-{
-    unsigned char *dst_p = dst;
-    unsigned char *src_p = src, *src_endp = src + len;
-    unsigned int dst_count = 0;
-    unsigned int matched_pos, matched_len;
-    unsigned int i;
-    unsigned char ch;
-    unsigned int last_bytes = 0;
+    /* no match could be longer than the rest of pattern */
+    good_len = pat_len;
+    if ((level->good_len != 0) && (level->good_len < good_len))
+        good_len = level->good_len;
 
-    if (enc->src_p_interrupted == NULL)
+    candidate = br->head_table[hash_value];
+    for (depth = 0; depth < level->max_chain; depth++)
     {
-        /* first 3 bytes */
-        i = 2;
-        while (src_p != src_endp && i > 0)
+        const unsigned char *ref;
+        unsigned int matched_len, limit;
+
+        /* stale positions are out of the window */
+        distance = br->absolute_pos - candidate;
+        if ((distance == 0) || (distance > br->grow)) break;
+        ref = BUFFER_RING_PTR(candidate, br);
+        candidate = br->chain_table[candidate & (br->size - 1)];
+
+        /* a candidate missing the byte right after the best length can not
+         * be longer, the match goes on in the pattern itself after
+         * reaching the end of ring */
+        if (((*ret_len < distance) ? ref[*ret_len] : pat[*ret_len - distance]) != pat[*ret_len]) continue;
+
+        limit = MIN(distance, pat_len);
+        matched_len = match_length(ref, pat, limit);
+        if ((matched_len == limit) && (limit < pat_len))
         {
-            last_bytes = (last_bytes << 8) | *(src_p);
-            buffer_ring_append(&enc->br, *(src_p));
-            /*buffer_ring_update_tables(&enc->br, ULZ77_HASH(last_bytes), enc->br.recent_pos[2]);*/
-            *dst_p++ = *src_p++;
-            dst_count++;
-            i--;
+            matched_len += match_length(pat, pat + distance, pat_len - distance);
         }
-        if (len >= 3)
+        if ((matched_len > *ret_len))
         {
-            last_bytes = (last_bytes << 8) | *(src_p);
-            buffer_ring_append(&enc->br, *(src_p));
-            buffer_ring_update_tables(&enc->br, ULZ77_HASH(last_bytes), enc->br.recent_pos[2]);
-            *dst_p++ = *src_p++;
-            dst_count++;
+            *ret_distance = distance;
+            *ret_len = matched_len;
+            if (matched_len >= good_len) return 0;
         }
     }
 
-    /* Middle part */
-    src_endp = src + len;
-    while (src_p != src_endp)
+    /* dictionary is farther than anything in ring, matches stop at its end */
+    if (br->dict != NULL)
     {
-        /* yield if buffer full */
-        if (dst_count >= dst_buffer_size - ULZ77_BUFFER_RESERVED_SIZE)
-        {
-            enc->src_p_interrupted = src_p;
-            enc->last_bytes = last_bytes;
-            enc->src_len = src_p - src;
-            enc->dst_len = dst_count;
-            enc->src_total_len += enc->src_len;
-            enc->dst_total_len += enc->dst_len;
-            return -ULZ77_ERR_BUFFER_FULL;
-        }
+        const struct ulz77_dict *dict = br->dict;
 
-        if (*src_p == SENTINEL)
+        candidate = dict->head_table[hash_value >> dict->hash_shift];
+        for (; (depth < level->max_chain) && (candidate != 0); depth++)
         {
-            /* matched */
-            src_p++;
-            matched_len = ((*src_p >> 4) & 0xF) + 3;
-            matched_pos = ((*src_p & 0xF) << 8) | (*(src_p + 1));
-            src_p += 2;
-            if (matched_len == 3 && matched_pos == 0)
-            {
-                last_bytes = (last_bytes << 8) | SENTINEL;
-                buffer_ring_append(&enc->br, SENTINEL);
-                buffer_ring_update_tables(&enc->br, ULZ77_HASH(last_bytes), enc->br.recent_pos[2]);
-                *dst_p++ = SENTINEL;
-                dst_count++;
-            }
-            else
+            const unsigned char *ref = dict->content + candidate - 1;
+            unsigned int matched_len, limit;
+
+            distance = br->grow + dict->len - (candidate - 1);
+            if (distance > br->size) break;
+            limit = MIN(dict->len - (candidate - 1), pat_len);
+            candidate = dict->chain_table[candidate - 1];
+
+            if ((limit <= *ret_len) || (ref[*ret_len] != pat[*ret_len])) continue;
+            matched_len = match_length(ref, pat, limit);
+            if (matched_len > *ret_len)
             {
-                if (matched_len == 18)
-                {
-                    if (((*src_p >> 7) & 0x01) == 0)
-                    {
-                        matched_len = 17 + (*src_p & 127);
-                        src_p++;
-                    }
-                    else if ((((*src_p >> 7) & 0x01) == 1) &&
-                            (src_p + 1 != src_endp) && (((*(src_p + 1) >> 7) & 0x01) == 0))
-                    {
-                        matched_len = 17 + (((*(src_p + 1) & 127) << 7) | (*src_p & 127));
-                        src_p += 2;
-                    }
-                    else
-                    {
-                        return -1; /* Unknown error */
-                    }
-                }
-                for (i = 0; i < matched_len; i++)
-                {
-                    ch = buffer_ring_get_from_relative(&enc->br, matched_pos + i);
-                    *(dst_p + i) = ch;
-                }
-                for (i = 0; i < matched_len; i++)
-                {
-                    last_bytes = (last_bytes << 8) | *(dst_p + i);
-                    buffer_ring_append(&enc->br, *(dst_p + i));
-                    buffer_ring_update_tables(&enc->br, ULZ77_HASH(last_bytes), enc->br.recent_pos[2]);
-                }
-                dst_count += matched_len;
-                dst_p += matched_len;
+                *ret_distance = distance;
+                *ret_len = matched_len;
+                if (matched_len >= good_len) break;
             }
         }
-        else
-        {
-            last_bytes = (last_bytes << 8) | *src_p;
-            buffer_ring_append(&enc->br, *src_p);
-            buffer_ring_update_tables(&enc->br, ULZ77_HASH(last_bytes), enc->br.recent_pos[2]);
-            *dst_p++ = *src_p++;
-            dst_count++;
-        }
     }
-
-    enc->src_p_interrupted = NULL;
-    enc->last_bytes = last_bytes;
-    enc->src_len = src_p - src;
-    enc->dst_len = dst_count;
-    enc->src_total_len += enc->src_len;
-    enc->dst_total_len += enc->dst_len;
-
     return 0;
 }
 
-#define ULZ77_TYPE_COMPRESSION 0
-#define ULZ77_TYPE_DECOMPRESSION 1
-
-/* Encode data */
-int ulz77_encode_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, int type)
+/* Collect matches of increasing length, each of them has the shortest
+ * distance among the candidates as long, return the number of matches */
+static unsigned int buffer_ring_find_all(struct buffer_ring *br, /* buffer ring */
+        const struct ulz77_level *level, /* searching parameters */
+        unsigned int hash_value, const unsigned char *pat, const unsigned char *pat_endp, /* arguments */
+        struct opt_match *matches) /* return values, OPT_MATCHES at most */
 {
-    int ret = 0;
-    struct ulz77_encoder *enc = NULL;
-
-    /* src */
-    unsigned char *src_p;
-    unsigned int task_len;
-
-    /* dst */
-    unsigned char *dst = NULL, *dst_p;
-    unsigned int dst_buffer_size;
-    unsigned int dst_buffer_remain_size;
-    unsigned char *new_buffer = NULL;
-
-    if (src == NULL) return -ULZ77_ERR_NULL_PTR;
+    uint32_t candidate; /* absolute position of candidate */
+    uint32_t distance;
+    unsigned int pat_len = (unsigned int)MIN(pat_endp - pat, MATCH_LEN_LIMIT);
+    unsigned int good_len; /* long enough to stop searching */
+    unsigned int depth; /* candidates visited */
+    unsigned int best_len = MATCH_LEN_MIN - 1;
+    unsigned int count = 0;
 
-    *dst_out = NULL;
-    *dst_out_len = 0;
+    good_len = pat_len;
+    if ((level->good_len != 0) && (level->good_len < good_len))
+        good_len = level->good_len;
+    if (pat_len < MATCH_LEN_MIN) return 0;
 
-    /* Create destination buffer */
-    dst_buffer_size = MAX(src_len * 3, BUFFER_SIZE);
-    dst_buffer_remain_size = dst_buffer_size;
-    dst = (unsigned char *)malloc(sizeof(unsigned char) * (dst_buffer_size));
-    if (dst == NULL)
+    candidate = br->head_table[hash_value];
+    for (depth = 0; depth < level->max_chain; depth++)
     {
-        ret = -ULZ77_ERR_MALLOC;
-        goto done;
-    }
+        const unsigned char *ref;
+        unsigned int matched_len, limit;
 
-    /* Create encoder */
-    enc = ulz77_encoder_new();
+        distance = br->absolute_pos - candidate;
+        if ((distance == 0) || (distance > br->grow)) break;
+        ref = BUFFER_RING_PTR(candidate, br);
+        candidate = br->chain_table[candidate & (br->size - 1)];
 
-    src_p = src;
-    dst_p = dst;
-    task_len = src_len;
-    for (;;)
-    {
-        if (type == ULZ77_TYPE_COMPRESSION)
-        {
-            ret = ulz77_encoder_encode(enc, dst_p, dst_buffer_remain_size, src_p, task_len);
-        }
-        else if (type == ULZ77_TYPE_DECOMPRESSION)
-        {
-            ret = ulz77_encoder_decode(enc, dst_p, dst_buffer_remain_size, src_p, task_len);
-        }
-        else
+        if (((best_len < distance) ? ref[best_len] : pat[best_len - distance]) != pat[best_len]) continue;
+
+        limit = MIN(distance, pat_len);
+        matched_len = match_length(ref, pat, limit);
+        if ((matched_len == limit) && (limit < pat_len))
         {
-            ret = -ULZ77_ERR_UNKNOWN_OP;
-            goto done;
+            matched_len += match_length(pat, pat + distance, pat_len - distance);
         }
-        if (ret == 0)
+        if (matched_len > best_len)
         {
-            *dst_out = dst;
-            *dst_out_len = enc->dst_total_len;
-            dst = NULL;
-            ret = 0;
-            goto done;
+            /* the longest one replaces the last when full */
+            if (count == OPT_MATCHES) count--;
+            matches[count].distance = distance;
+            matches[count].len = matched_len;
+            count++;
+            best_len = matched_len;
+            if (matched_len >= good_len) return count;
         }
-        else if (ret == -ULZ77_ERR_BUFFER_FULL)
+    }
+
+    /* dictionary is farther than anything in ring, matches stop at its end */
+    if (br->dict != NULL)
+    {
+        const struct ulz77_dict *dict = br->dict;
+
+        candidate = dict->head_table[hash_value >> dict->hash_shift];
+        for (; (depth < level->max_chain) && (candidate != 0); depth++)
         {
-            /* extend buffer */
-            dst_buffer_size <<= 1;
-            new_buffer = (unsigned char *)malloc(sizeof(unsigned char) * dst_buffer_size);
-            if (new_buffer == NULL)
+            const unsigned char *ref = dict->content + candidate - 1;
+            unsigned int matched_len, limit;
+
+            distance = br->grow + dict->len - (candidate - 1);
+            if (distance > br->size) break;
+            limit = MIN(dict->len - (candidate - 1), pat_len);
+            candidate = dict->chain_table[candidate - 1];
+
+            if ((limit <= best_len) || (ref[best_len] != pat[best_len])) continue;
+            matched_len = match_length(ref, pat, limit);
+            if (matched_len > best_len)
             {
-                ret = -ULZ77_ERR_MALLOC;
-                goto done;
+                if (count == OPT_MATCHES) count--;
+                matches[count].distance = distance;
+                matches[count].len = matched_len;
+                count++;
+                best_len = matched_len;
+                if (matched_len >= good_len) break;
             }
-            memcpy(new_buffer, dst, enc->dst_total_len);
-            free(dst);dst = new_buffer;new_buffer = NULL;
-            dst_buffer_remain_size = dst_buffer_size - enc->dst_total_len;
-            task_len -= enc->src_len;
-            src_p = ulz77_encoder_get_previous(enc);
-            dst_p = dst + enc->dst_total_len;
         }
     }
-done:
-    if (enc != NULL) ulz77_encoder_destroy(enc);
-    return ret;
+    return count;
 }
 
-/* Compress data */
-int ulz77_compress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len)
+int buffer_ring_uninit(struct buffer_ring *br)
 {
-    return ulz77_encode_data(dst_out, dst_out_len, src, src_len, ULZ77_TYPE_COMPRESSION);
+    if (br->buf) mem_free(br->buf);
+    if (br->head_table) mem_free(br->head_table);
+    if (br->chain_table) mem_free(br->chain_table);
+    return 0;
 }
 
-/* Decompress data */
-int ulz77_decompress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len)
+/* Create a preset dictionary, every position is linked into the chains
+ * once here, encoders search them without copying anything */
+struct ulz77_dict *ulz77_dict_create(const unsigned char *buf, size_t len)
 {
-    return ulz77_encode_data(dst_out, dst_out_len, src, src_len, ULZ77_TYPE_DECOMPRESSION);
+    struct ulz77_dict *dict;
+    unsigned int hash_bit = 8;
+    uint32_t i, hash_value, id = 2166136261U;
+
+    if ((buf == NULL) && (len != 0)) return NULL;
+    if (len > ULZ77_DICT_SIZE_MAX)
+    {
+        buf += len - ULZ77_DICT_SIZE_MAX;
+        len = ULZ77_DICT_SIZE_MAX;
+    }
+    /* about a slot per position */
+    while ((hash_bit < ULZ77_HASH_SIZE_BIT) && ((1UL << hash_bit) < len)) hash_bit++;
+
+    dict = (struct ulz77_dict *)mem_alloc(sizeof(struct ulz77_dict));
+    if (dict == NULL) return NULL;
+    dict->len = (uint32_t)len;
+    dict->hash_shift = ULZ77_HASH_SIZE_BIT - hash_bit;
+    dict->content = (unsigned char *)mem_alloc(MAX(len, 1));
+    dict->head_table = (uint32_t *)mem_calloc(1U << hash_bit, sizeof(uint32_t));
+    dict->chain_table = (uint32_t *)mem_alloc(sizeof(uint32_t) * MAX(len, 1));
+    if ((dict->content == NULL) || (dict->head_table == NULL) || (dict->chain_table == NULL))
+    {
+        ulz77_dict_destroy(dict);
+        return NULL;
+    }
+    if (len != 0) memcpy(dict->content, buf, len);
+
+    for (i = 0; i + ULZ77_HASH_LITERAL_SIZE <= dict->len; i++)
+    {
+        hash_value = ULZ77_HASH(read_u32(dict->content + i)) >> dict->hash_shift;
+        dict->chain_table[i] = dict->head_table[hash_value];
+        dict->head_table[hash_value] = i + 1;
+    }
+
+    /* FNV-1a of the content, 0 is never an ID */
+    for (i = 0; i < dict->len; i++) id = (id ^ dict->content[i]) * 16777619U;
+    dict->id = (id != 0) ? id : 1;
+
+    return dict;
 }
 
-/* Encode file */
-int ulz77_encode_file(const char *filename_dst, const char *filename_src, int type)
+/* Destroy dictionary */
+int ulz77_dict_destroy(struct ulz77_dict *dict)
 {
-    int ret = 0;
-    FILE *fp_src = NULL, *fp_dst = NULL;
+    if (dict == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (dict->content != NULL) mem_free(dict->content);
+    if (dict->head_table != NULL) mem_free(dict->head_table);
+    if (dict->chain_table != NULL) mem_free(dict->chain_table);
+    mem_free(dict);
+    return 0;
+}
 
-    /* src */
-    unsigned char *src = NULL;
-    size_t src_len;
+/* Get ID of dictionary */
+uint32_t ulz77_dict_id(const struct ulz77_dict *dict)
+{
+    return (dict != NULL) ? dict->id : 0;
+}
 
-    /* dst */
-    unsigned char *dst = NULL;
-    size_t dst_len;
+/* Hash of the substring at pos of samples, TRAIN_INVALID if it crosses
+ * the end of the sample, *sample_idx follows pos forward */
+static __inline uint32_t train_hash(const unsigned char *samples, const size_t *sample_ends, \
+        size_t *sample_idx, size_t pos, unsigned int hash_bit)
+{
+    while (pos >= sample_ends[*sample_idx]) (*sample_idx)++;
+    if (pos + TRAIN_DMER_SIZE > sample_ends[*sample_idx]) return TRAIN_INVALID;
+    return (uint32_t)((read_u64(samples + pos) * 0x9E3779B185EBCA87ULL) >> (64 - hash_bit));
+}
 
-    /* Open files */
-    fp_src = fopen(filename_src, "rb");
-    if (fp_src == NULL)
+/* Index of sample containing pos */
+static size_t train_sample_idx(const size_t *sample_ends, size_t sample_count, size_t pos)
+{
+    size_t low = 0, high = sample_count - 1, mid;
+
+    while (low < high)
     {
-        ret = -ULZ77_ERR_FILE_OPEN;
-        goto done;
+        mid = low + (high - low) / 2;
+        if (sample_ends[mid] <= pos) low = mid + 1; else high = mid;
     }
+    return low;
+}
 
-    /* Get source file length */
-    fseek(fp_src, 0, SEEK_END);
-    src_len = ftell(fp_src);
-    fseek(fp_src, 0, SEEK_SET);
+/* Train a dictionary of at most dict_cap bytes from samples concatenated
+ * one after another.
+ * A substring of TRAIN_DMER_SIZE bytes is worth the number of other samples
+ * containing it. The samples are divided into epochs, the segment of the
+ * greatest worth in each epoch is taken, and the substrings of it are worth
+ * nothing since then, until the dictionary is full or nothing is worth.
+ * The segments taken first are put at the end, the nearest to data */
+int ulz77_dict_train(unsigned char *dict, size_t dict_cap, size_t *dict_len, \
+        const unsigned char *samples, const size_t *sample_sizes, size_t sample_count)
+{
+    int ret = 0;
+    size_t *sample_ends = NULL;
+    uint32_t *freq = NULL, *counts = NULL, *window = NULL;
+    size_t total = 0, i, dict_pos, seg_size, seg_dmers, epochs, epoch_size, epoch;
+    size_t begin, end, pos, sample_idx, best_begin, best_score, score, n;
+    unsigned int hash_bit = 10;
+    uint32_t h;
+    int taken;
 
-    /* Allocate space for source */
-    src = (unsigned char *)malloc(sizeof(unsigned char) * src_len);
-    if (src == NULL)
+    if ((dict == NULL) || (dict_len == NULL) || (samples == NULL) || (sample_sizes == NULL)) return -ULZ77_ERR_NULL_PTR;
+    *dict_len = 0;
+    if ((sample_count == 0) || (dict_cap == 0)) return -ULZ77_ERR_INVALID_ARGS;
+
+    sample_ends = (size_t *)mem_alloc(sizeof(size_t) * sample_count);
+    if (sample_ends == NULL) { ret = -ULZ77_ERR_MALLOC; goto fail; }
+    for (i = 0; i < sample_count; i++)
     {
-        ret = -ULZ77_ERR_MALLOC;
-        goto done;
+        if (sample_sizes[i] > (size_t)-1 - total) { ret = -ULZ77_ERR_INVALID_ARGS; goto fail; }
+        total += sample_sizes[i];
+        sample_ends[i] = total;
     }
+    if (total < TRAIN_DMER_SIZE) { ret = -ULZ77_ERR_INVALID_ARGS; goto fail; }
 
-    if (fread(src, src_len, 1, fp_src) < 1) 
+    while ((hash_bit < TRAIN_HASH_BIT_MAX) && ((1UL << hash_bit) < total)) hash_bit++;
+    seg_size = MIN(MAX(dict_cap / 8, TRAIN_SEGMENT_MIN), TRAIN_SEGMENT_MAX);
+    seg_size = MAX(MIN(seg_size, MIN(dict_cap, total)), TRAIN_DMER_SIZE);
+    seg_dmers = seg_size - TRAIN_DMER_SIZE + 1;
+
+    freq = (uint32_t *)mem_calloc(1UL << hash_bit, sizeof(uint32_t));
+    /* the last sample containing a substring, then its count in the segment */
+    counts = (uint32_t *)mem_calloc(1UL << hash_bit, sizeof(uint32_t));
+    window = (uint32_t *)mem_alloc(sizeof(uint32_t) * seg_dmers);
+    if ((freq == NULL) || (counts == NULL) || (window == NULL)) { ret = -ULZ77_ERR_MALLOC; goto fail; }
+
+    sample_idx = 0;
+    for (pos = 0; pos < total; pos++)
     {
-        ret = ULZ77_ERR_FILE_READ;
-        goto done;
+        if ((h = train_hash(samples, sample_ends, &sample_idx, pos, hash_bit)) == TRAIN_INVALID) continue;
+        if (counts[h] == (uint32_t)sample_idx + 1) continue;
+        if (counts[h] != 0) freq[h]++;
+        counts[h] = (uint32_t)sample_idx + 1;
     }
+    memset(counts, 0, sizeof(uint32_t) << hash_bit);
 
-    ret = ulz77_encode_data(&dst, &dst_len, src, src_len, type);
-    if (ret == 0)
+    epochs = MAX(dict_cap / seg_size, 1);
+    epoch_size = MAX(total / epochs, seg_size);
+    epochs = (total + epoch_size - 1) / epoch_size;
+    dict_pos = dict_cap;
+    do
+    {
+        taken = 0;
+        for (epoch = 0; (epoch < epochs) && (dict_pos != 0); epoch++)
+        {
+            begin = epoch * epoch_size;
+            end = MIN(begin + epoch_size, total);
+            if (end - begin < seg_size) begin = end - seg_size;
+
+            /* slide the segment, each substring is counted once */
+            best_begin = begin; best_score = 0; score = 0;
+            sample_idx = train_sample_idx(sample_ends, sample_count, begin);
+            for (pos = begin; pos + TRAIN_DMER_SIZE <= end; pos++)
+            {
+                if (pos >= begin + seg_dmers)
+                {
+                    h = window[(pos - seg_dmers) % seg_dmers];
+                    if ((h != TRAIN_INVALID) && (--counts[h] == 0)) score -= freq[h];
+                }
+                h = train_hash(samples, sample_ends, &sample_idx, pos, hash_bit);
+                window[pos % seg_dmers] = h;
+                if ((h != TRAIN_INVALID) && (counts[h]++ == 0)) score += freq[h];
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_begin = (pos + 1 >= begin + seg_dmers) ? pos + 1 - seg_dmers : begin;
+                }
+            }
+            for (i = (pos >= begin + seg_dmers) ? pos - seg_dmers : begin; i < pos; i++)
+            {
+                h = window[i % seg_dmers];
+                if (h != TRAIN_INVALID) counts[h] = 0;
+            }
+            if (best_score == 0) continue;
+
+            n = MIN(seg_size, dict_pos);
+            dict_pos -= n;
+            memcpy(dict + dict_pos, samples + best_begin, n);
+            sample_idx = train_sample_idx(sample_ends, sample_count, best_begin);
+            for (pos = best_begin; pos + TRAIN_DMER_SIZE <= best_begin + seg_size; pos++)
+            {
+                h = train_hash(samples, sample_ends, &sample_idx, pos, hash_bit);
+                if (h != TRAIN_INVALID) freq[h] = 0;
+            }
+            taken = 1;
+        }
+    } while (taken && (dict_pos != 0));
+
+    *dict_len = dict_cap - dict_pos;
+    if (dict_pos != 0) memmove(dict, dict + dict_pos, *dict_len);
+
+fail:
+    if (sample_ends != NULL) mem_free(sample_ends);
+    if (freq != NULL) mem_free(freq);
+    if (counts != NULL) mem_free(counts);
+    if (window != NULL) mem_free(window);
+    return ret;
+}
+
+/* Set allocator of library */
+int ulz77_set_allocator(const struct ulz77_allocator *new_allocator)
+{
+    if (new_allocator == NULL)
+    {
+        allocator.alloc_fn = default_alloc;
+        allocator.realloc_fn = default_realloc;
+        allocator.free_fn = default_free;
+        allocator.opaque = NULL;
+        return 0;
+    }
+    if ((new_allocator->alloc_fn == NULL) || (new_allocator->realloc_fn == NULL) || \
+            (new_allocator->free_fn == NULL)) return -ULZ77_ERR_NULL_PTR;
+    allocator = *new_allocator;
+    return 0;
+}
+
+/* Create new encoder */
+struct ulz77_encoder *ulz77_encoder_new(void)
+{
+    return ulz77_encoder_new_level(ULZ77_LEVEL_DEFAULT);
+}
+
+/* Create new encoder with specified compression level */
+struct ulz77_encoder *ulz77_encoder_new_level(int level)
+{
+    struct ulz77_params params;
+
+    ulz77_params_init(&params);
+    params.level = level;
+    return ulz77_encoder_new_params(&params);
+}
+
+/* Initialize encoder parameters with default values */
+int ulz77_params_init(struct ulz77_params *params)
+{
+    if (params == NULL) return -ULZ77_ERR_NULL_PTR;
+    params->level = ULZ77_LEVEL_DEFAULT;
+    params->window_log = ULZ77_WINDOW_LOG_DEFAULT;
+    params->flags = 0;
+    params->dict = NULL;
+    return 0;
+}
+
+/* Check encoder parameters */
+static int params_check(const struct ulz77_params *params)
+{
+    if (params == NULL) return -ULZ77_ERR_NULL_PTR;
+    if ((params->level < ULZ77_LEVEL_MIN) || (params->level > ULZ77_LEVEL_MAX)) return -ULZ77_ERR_INVALID_ARGS;
+    if ((params->window_log < ULZ77_WINDOW_LOG_MIN) || (params->window_log > ULZ77_WINDOW_LOG_MAX)) return -ULZ77_ERR_INVALID_ARGS;
+    if ((params->flags & ~HEADER_FLAGS_SUPPORTED) != 0) return -ULZ77_ERR_INVALID_ARGS;
+    /* the flag follows the dictionary */
+    if ((params->flags & ULZ77_FLAG_DICT) != 0) return -ULZ77_ERR_INVALID_ARGS;
+    return 0;
+}
+
+/* Set up encoder of params, whose ring is initialized */
+static void encoder_setup(struct ulz77_encoder *enc, const struct ulz77_params *params)
+{
+    enc->level = ulz77_levels[params->level];
+    enc->window_log = params->window_log;
+    enc->flags = params->flags;
+    /* entropy coding works on sequences */
+    if ((enc->flags & ULZ77_FLAG_ENTROPY) != 0) enc->flags |= ULZ77_FLAG_SEQUENCE;
+    enc->br.dict = params->dict;
+    if (params->dict != NULL) enc->flags |= ULZ77_FLAG_DICT;
+    enc->entropy_buf = NULL;
+    enc->entropy_capacity = 0;
+    enc->is_static = 0;
+    enc->opt = NULL;
+    enc->dec = NULL;
+    enc->src_p_interrupted = NULL;
+    enc->src_len = 0;
+    enc->dst_len = 0;
+    enc->src_total_len = 0;
+    enc->dst_total_len = 0;
+}
+
+/* Create new encoder with specified parameters */
+struct ulz77_encoder *ulz77_encoder_new_params(const struct ulz77_params *params)
+{
+    struct ulz77_encoder *enc;
+
+    if (params_check(params) != 0) return NULL;
+
+    enc = (struct ulz77_encoder *)mem_alloc(sizeof(struct ulz77_encoder));
+    if (enc == NULL) return NULL;
+    if (buffer_ring_init(&enc->br, 1U << params->window_log, NULL) != 0)
+    {
+        mem_free(enc);
+        return NULL;
+    }
+    encoder_setup(enc, params);
+    if (enc->level.optimal != 0)
+    {
+        enc->opt = (struct ulz77_opt_node *)mem_alloc(sizeof(struct ulz77_opt_node) * (OPT_SIZE + 1));
+        if (enc->opt == NULL)
+        {
+            buffer_ring_uninit(&enc->br);
+            mem_free(enc);
+            return NULL;
+        }
+    }
+
+    return enc;
+}
+
+/* Size of the parts of a static encoder, each starts at a cache line,
+ * with the sequences of entropy coded blocks up to max_len bytes */
+static size_t encoder_workspace_parts(const struct ulz77_params *params, size_t max_len, size_t *ring_size, size_t *opt_size)
+{
+    size_t entropy_size = 0;
+
+    *ring_size = WORKSPACE_ALIGN_UP(buffer_ring_workspace_size(1U << params->window_log));
+    *opt_size = 0;
+    if (ulz77_levels[params->level].optimal != 0)
+        *opt_size = WORKSPACE_ALIGN_UP(sizeof(struct ulz77_opt_node) * (OPT_SIZE + 1));
+    if ((params->flags & ULZ77_FLAG_ENTROPY) != 0)
+        entropy_size = entropy_sequences_bound(max_len) * 4;
+
+    return WORKSPACE_ALIGN_UP(sizeof(struct ulz77_encoder)) + *ring_size + *opt_size + entropy_size;
+}
+
+/* Bytes of workspace for a static encoder */
+size_t ulz77_workspace_size(const struct ulz77_params *params)
+{
+    if (params_check(params) != 0) return 0;
+    return ulz77_workspace_size_block(params, (size_t)1 << params->window_log);
+}
+
+/* Bytes of workspace for a static encoder of blocks up to max_len bytes */
+size_t ulz77_workspace_size_block(const struct ulz77_params *params, size_t max_len)
+{
+    size_t ring_size, opt_size;
+
+    if (params_check(params) != 0) return 0;
+    /* no less than the window size, which every workspace takes */
+    max_len = MAX(max_len, (size_t)1 << params->window_log);
+    if (max_len > (size_t)SIZE_MAX / 16) return 0;
+    /* mem of caller may start anywhere in a cache line */
+    return encoder_workspace_parts(params, max_len, &ring_size, &opt_size) + WORKSPACE_ALIGN - 1;
+}
+
+/* Initialize encoder in workspace, the rest of workspace after the fixed
+ * parts takes the sequences of entropy coded blocks */
+struct ulz77_encoder *ulz77_encoder_init_static(void *mem, size_t len, const struct ulz77_params *params)
+{
+    struct ulz77_encoder *enc;
+    unsigned char *mem_p, *mem_endp;
+    size_t ring_size, opt_size;
+
+    if ((mem == NULL) || (params_check(params) != 0)) return NULL;
+    if (len < ulz77_workspace_size(params)) return NULL;
+    encoder_workspace_parts(params, (size_t)1 << params->window_log, &ring_size, &opt_size);
+
+    mem_endp = (unsigned char *)mem + len;
+    mem_p = (unsigned char *)mem + ((WORKSPACE_ALIGN - (uintptr_t)mem % WORKSPACE_ALIGN) % WORKSPACE_ALIGN);
+    enc = (struct ulz77_encoder *)mem_p;
+    mem_p += WORKSPACE_ALIGN_UP(sizeof(struct ulz77_encoder));
+    buffer_ring_init(&enc->br, 1U << params->window_log, mem_p);
+    mem_p += ring_size;
+    encoder_setup(enc, params);
+    enc->is_static = 1;
+    if (opt_size != 0)
+    {
+        enc->opt = (struct ulz77_opt_node *)mem_p;
+        mem_p += opt_size;
+    }
+    if ((enc->flags & ULZ77_FLAG_ENTROPY) != 0)
+    {
+        enc->entropy_buf = mem_p;
+        enc->entropy_capacity = (size_t)(mem_endp - mem_p);
+    }
+
+    return enc;
+}
+
+/* Destroy encoder, a static one only drops the decoder it created */
+int ulz77_encoder_destroy(struct ulz77_encoder *enc)
+{
+    if (enc == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (enc->is_static)
+    {
+        if (enc->dec != NULL) ulz77_decoder_destroy(enc->dec);
+        return 0;
+    }
+    buffer_ring_uninit(&enc->br);
+    if (enc->opt != NULL) mem_free(enc->opt);
+    if (enc->entropy_buf != NULL) mem_free(enc->entropy_buf);
+    if (enc->dec != NULL) ulz77_decoder_destroy(enc->dec);
+    mem_free(enc);
+    return 0;
+}
+
+/* Reset encoder for data independent of what it encoded, the tables are
+ * kept and invalidated by moving the positions, an interrupted block is dropped */
+int ulz77_encoder_reset(struct ulz77_encoder *enc)
+{
+    if (enc == NULL) return -ULZ77_ERR_NULL_PTR;
+    buffer_ring_reset(&enc->br);
+    enc->src_p_interrupted = NULL;
+    enc->src_len = 0;
+    enc->dst_len = 0;
+    enc->src_total_len = 0;
+    enc->dst_total_len = 0;
+    return 0;
+}
+
+/* Parse greedily with lazy matching, return the position of src where
+ * it stopped, which is not src_endp if the dst buffer is full */
+static unsigned char *encoder_parse_lazy(struct ulz77_encoder *enc, struct token_writer *w, \
+        unsigned char *src_p, unsigned char *src_endp, unsigned char *src_hash_endp)
+{
+    unsigned int matched_distance, matched_len, hash_value = 0;
+    unsigned int next_distance, next_len, next_hash_value;
+    unsigned int lazy_step, appended;
+
+    while (src_p != src_endp) 
+    {
+        /* yield if buffer full */
+        if (writer_room(w, src_p) == 0) break;
+
+        /* find from history */
+        matched_len = 0;
+        if (src_p < src_hash_endp)
+        {
+            hash_value = ULZ77_HASH(read_u32(src_p));
+            buffer_ring_find(&enc->br, &enc->level, hash_value, src_p, src_endp, &matched_distance, &matched_len);
+        }
+
+        /* repeat string in history ring, and cheaper to reference? */
+        if ((matched_len >= MATCH_LEN_MIN) && (writer_match_cost(w, matched_distance, matched_len) < matched_len))
+        {
+            /* lazy matching, emit the byte as a literal if a longer match
+             * starts right after it, the byte is put into history buffer
+             * before searching the next position */
+            appended = 0;
+            for (lazy_step = 0; (lazy_step < enc->level.lazy) && (src_p + 1 < src_hash_endp) && \
+                    ((enc->level.good_len == 0) || (matched_len < enc->level.good_len)) && \
+                    (writer_room(w, src_p) != 0); lazy_step++)
+            {
+                buffer_ring_insert(&enc->br, hash_value, enc->br.absolute_pos);
+                buffer_ring_append(&enc->br, *src_p);
+                appended = 1;
+
+                next_hash_value = ULZ77_HASH(read_u32(src_p + 1));
+                buffer_ring_find(&enc->br, &enc->level, next_hash_value, src_p + 1, src_endp, &next_distance, &next_len);
+                if ((next_len <= matched_len) || (writer_match_cost(w, next_distance, next_len) >= next_len)) break;
+
+                writer_literal(w, src_p);
+                src_p++;
+                appended = 0;
+                hash_value = next_hash_value;
+                matched_distance = next_distance;
+                matched_len = next_len;
+            }
+
+            writer_match(w, src_p, matched_distance, matched_len);
+
+            /* add symbols into history buffer */
+            buffer_ring_append_bulk(&enc->br, src_p + appended, matched_len - appended, \
+                    (unsigned int)MIN((size_t)(matched_len - appended), (size_t)(src_hash_endp - (src_p + appended))));
+            src_p += matched_len;
+        }
+        else
+        {
+            if (src_p < src_hash_endp)
+                buffer_ring_insert(&enc->br, hash_value, enc->br.absolute_pos);
+            buffer_ring_append(&enc->br, *src_p);
+            writer_literal(w, src_p);
+            src_p++;
+        }
+    }
+
+    return src_p;
+}
+
+/* Take the step if it reaches the node of optimal parsing cheaper */
+static __inline void opt_relax(struct ulz77_opt_node *node, uint32_t price, unsigned int len, unsigned int distance)
+{
+    if (price < node->price)
+    {
+        node->price = price;
+        node->len = len;
+        node->distance = distance;
+    }
+}
+
+/* Parse segments of src optimally, every position is reached with the
+ * cheapest path in bytes of output, return the position of src where
+ * it stopped, which is not src_endp if the dst buffer is full */
+static unsigned char *encoder_parse_optimal(struct ulz77_encoder *enc, struct token_writer *w, \
+        unsigned char *src_p, unsigned char *src_endp, unsigned char *src_hash_endp)
+{
+    struct ulz77_opt_node *opt = enc->opt;
+    struct opt_match matches[OPT_MATCHES];
+    unsigned int seg_len, end, reach, i, l, k, count, hash_value;
+    unsigned int step_len, step_distance, next_len, next_distance;
+
+    while (src_p != src_endp)
+    {
+        /* a segment never takes more than 2 bytes per byte of src */
+        seg_len = (unsigned int)MIN((size_t)(src_endp - src_p), writer_room(w, src_p) / 2);
+        seg_len = MIN(seg_len, OPT_SIZE);
+        if (seg_len == 0) break;
+
+        /* forward pass, the price of a node is final once it is reached,
+         * nodes are initialized as far as the steps reach */
+        opt[0].price = 0;
+        opt[0].len = 0;
+        reach = 0;
+        end = seg_len;
+        for (i = 0; i < end; i++)
+        {
+            count = 0;
+            if (src_p + i < src_hash_endp)
+            {
+                hash_value = ULZ77_HASH(read_u32(src_p + i));
+                count = buffer_ring_find_all(&enc->br, &enc->level, hash_value, src_p + i, src_p + end, matches);
+                buffer_ring_insert(&enc->br, hash_value, enc->br.absolute_pos);
+            }
+            buffer_ring_append(&enc->br, src_p[i]);
+
+            l = (count != 0) ? matches[count - 1].len : 1;
+            for (; reach < i + l; reach++) opt[reach + 1].price = UINT32_MAX;
+            opt_relax(&opt[i + 1], opt[i].price + writer_literal_cost(w, src_p[i]), 1, 0);
+
+            /* a match long enough is taken at once, and ends the segment */
+            if ((count != 0) && (enc->level.good_len != 0) && (matches[count - 1].len >= enc->level.good_len))
+            {
+                l = matches[count - 1].len;
+                opt[i + l].price = opt[i].price + writer_match_cost(w, matches[count - 1].distance, l);
+                opt[i + l].len = l;
+                opt[i + l].distance = matches[count - 1].distance;
+                buffer_ring_append_bulk(&enc->br, src_p + i + 1, l - 1, \
+                        (unsigned int)MIN((size_t)(l - 1), (size_t)(src_hash_endp - (src_p + i + 1))));
+                end = i + l;
+                break;
+            }
+
+            /* lengths up to the previous match are cheaper with its distance */
+            l = MATCH_LEN_MIN;
+            for (k = 0; k < count; k++)
+            {
+                for (; l <= matches[k].len; l++)
+                {
+                    opt_relax(&opt[i + l], opt[i].price + writer_match_cost(w, matches[k].distance, l), l, matches[k].distance);
+                }
+            }
+        }
+
+        /* backward pass, turn the last steps into the next steps */
+        i = end;
+        step_len = opt[i].len;
+        step_distance = opt[i].distance;
+        while (i != 0)
+        {
+            i -= step_len;
+            next_len = opt[i].len;
+            next_distance = opt[i].distance;
+            opt[i].len = step_len;
+            opt[i].distance = step_distance;
+            step_len = next_len;
+            step_distance = next_distance;
+        }
+
+        /* emit tokens along the path */
+        for (i = 0; i < end; i += opt[i].len)
+        {
+            if (opt[i].distance == 0)
+                writer_literal(w, src_p + i);
+            else
+                writer_match(w, src_p + i, opt[i].distance, opt[i].len);
+        }
+        src_p += end;
+    }
+
+    return src_p;
+}
+
+/* Flags in header of the block to encode, a linked block with nothing
+ * before it starts a chain, which the decoder begins with no window */
+static __inline unsigned int encoder_block_flags(const struct ulz77_encoder *enc)
+{
+    if (enc->br.grow == 0) return enc->flags & ~ULZ77_FLAG_LINKED;
+    return enc->flags;
+}
+
+/* Encode a block of entropy coded sequences, which is done in one call
+ * since the streams are written after all the sequences are known */
+static int encoder_encode_entropy(struct ulz77_encoder *enc, \
+        unsigned char *dst, size_t dst_buffer_size, \
+        unsigned char *src, size_t len)
+{
+    struct token_writer w;
+    unsigned char *src_p = src, *src_endp = src + len;
+    unsigned char *src_hash_endp = (len >= ULZ77_HASH_LITERAL_SIZE) ? (src_endp - ULZ77_HASH_LITERAL_SIZE + 1) : src;
+    unsigned char *dst_p, *new_buffer;
+    size_t seq_capacity = entropy_sequences_bound(len), seq_len;
+    unsigned int flags;
+
+    /* sequences, then the streams split from them */
+    if (enc->entropy_capacity < seq_capacity * 4)
+    {
+        if (enc->is_static) return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+        new_buffer = (unsigned char *)mem_realloc(enc->entropy_buf, seq_capacity * 4);
+        if (new_buffer == NULL) return -ULZ77_ERR_MALLOC;
+        enc->entropy_buf = new_buffer;
+        enc->entropy_capacity = seq_capacity * 4;
+    }
+
+    /* blocks never reference each other unless linked */
+    if ((enc->flags & ULZ77_FLAG_LINKED) == 0) buffer_ring_reset(&enc->br);
+    flags = encoder_block_flags(enc);
+    w.dst_p = enc->entropy_buf;
+    w.dst_endp = enc->entropy_buf + seq_capacity;
+    w.sequence = 1;
+    w.literal_p = NULL;
+    if (enc->opt != NULL)
+        src_p = encoder_parse_optimal(enc, &w, src_p, src_endp, src_hash_endp);
+    else
+        src_p = encoder_parse_lazy(enc, &w, src_p, src_endp, src_hash_endp);
+    if (src_p != src_endp) return -ULZ77_ERR_UNKNOWN;
+    writer_flush(&w, src_p, 1);
+    seq_len = (size_t)(w.dst_p - enc->entropy_buf);
+
+    /* no stream is longer than it is raw, which takes the sequences */
+    if (dst_buffer_size < ULZ77_HEADER_SIZE_MAX + STREAM_RAW_HEADER_SIZE_MAX * STREAM_COUNT + seq_len)
+        return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    dst_p = dst + write_header(dst, enc->window_log, flags, len, ulz77_dict_id(enc->br.dict));
+    dst_p = write_entropy(dst_p, enc->entropy_buf, seq_len, enc->entropy_buf + seq_capacity);
+    if (dst_p == NULL) return -ULZ77_ERR_UNKNOWN;
+
+    enc->src_p_interrupted = NULL;
+    enc->src_len = len;
+    enc->dst_len = dst_p - dst;
+    enc->src_total_len += enc->src_len;
+    enc->dst_total_len += enc->dst_len;
+
+    return 0;
+}
+
+/* Encode data, a call which is not a continuation of an interrupted
+ * one starts a new block with the header */
+int ulz77_encoder_encode(struct ulz77_encoder *enc, \
+        unsigned char *dst, size_t dst_buffer_size, \
+        unsigned char *src, size_t len)
+{
+    int ret = 0;
+    struct token_writer w;
+    unsigned char *src_p = src, *src_endp = src + len;
+    unsigned char *src_hash_endp; /* positions before it are followed by enough bytes to hash */
+
+    if (dst_buffer_size < ULZ77_HEADER_SIZE_MAX + SEQUENCE_RESERVED_SIZE)
+        return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    if ((enc->flags & ULZ77_FLAG_ENTROPY) != 0)
+        return encoder_encode_entropy(enc, dst, dst_buffer_size, src, len);
+    src_hash_endp = (len >= ULZ77_HASH_LITERAL_SIZE) ? (src_endp - ULZ77_HASH_LITERAL_SIZE + 1) : src;
+
+    w.dst_p = dst;
+    w.dst_endp = dst + dst_buffer_size;
+    w.sequence = ((enc->flags & ULZ77_FLAG_SEQUENCE) != 0);
+    w.literal_p = NULL;
+
+    if (enc->src_p_interrupted == NULL)
+    {
+        /* blocks never reference each other unless linked */
+        if ((enc->flags & ULZ77_FLAG_LINKED) == 0) buffer_ring_reset(&enc->br);
+        w.dst_p += write_header(w.dst_p, enc->window_log, encoder_block_flags(enc), len, ulz77_dict_id(enc->br.dict));
+    }
+
+    if (enc->opt != NULL)
+        src_p = encoder_parse_optimal(enc, &w, src_p, src_endp, src_hash_endp);
+    else
+        src_p = encoder_parse_lazy(enc, &w, src_p, src_endp, src_hash_endp);
+
+    /* yield if buffer full */
+    if (src_p != src_endp)
+    {
+        writer_flush(&w, src_p, 0);
+        enc->src_p_interrupted = src_p;
+        ret = -ULZ77_ERR_BUFFER_FULL;
+    }
+    else
+    {
+        writer_flush(&w, src_p, 1);
+        enc->src_p_interrupted = NULL;
+    }
+    enc->src_len = src_p - src;
+    enc->dst_len = w.dst_p - dst;
+    enc->src_total_len += enc->src_len;
+    enc->dst_total_len += enc->dst_len;
+
+    return ret;
+}
+
+unsigned char *ulz77_encoder_get_previous(struct ulz77_encoder *enc)
+{
+    return enc->src_p_interrupted;
+}
+
+/* Decode data (kept for compatibility, decodes through ulz77_decoder) */
+int ulz77_encoder_decode(struct ulz77_encoder *enc, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len)
+{
+    int ret;
+
+    if (enc->dec == NULL)
+    {
+        enc->dec = ulz77_decoder_new();
+        if (enc->dec == NULL) return -ULZ77_ERR_MALLOC;
+    }
+    enc->dec->src_p_interrupted = enc->src_p_interrupted;
+    ret = ulz77_decoder_decode(enc->dec, dst, dst_buffer_size, src, len);
+    enc->src_p_interrupted = enc->dec->src_p_interrupted;
+    enc->src_len = enc->dec->src_len;
+    enc->dst_len = enc->dec->dst_len;
+    enc->src_total_len = enc->dec->src_total_len;
+    enc->dst_total_len = enc->dec->dst_total_len;
+
+    return ret;
+}
+
+/* Initialize decoder, which could be on stack */
+static void decoder_init(struct ulz77_decoder *dec)
+{
+    /* window is allocated once the window size is known */
+    dec->window = NULL;
+    dec->window_len = 0;
+    dec->window_size = BUFFER_SIZE;
+    dec->window_capacity = 0;
+    dec->format = ULZ77_FORMAT_V1;
+    dec->head_remain = 0;
+    dec->content_size = 0;
+    dec->block_len = 0;
+    dec->flags = 0;
+    dec->dict = NULL;
+    dec->dict_len = 0;
+    dec->keep_window = 1;
+    dec->is_static = 0;
+    dec->sequence_stage = 0;
+    dec->match_remain = 0;
+    dec->entropy_buf = NULL;
+    dec->entropy_capacity = 0;
+    dec->src_p_interrupted = NULL;
+    dec->src_len = 0;
+    dec->dst_len = 0;
+    dec->src_total_len = 0;
+    dec->dst_total_len = 0;
+}
+
+/* Free buffers of decoder */
+static void decoder_release(struct ulz77_decoder *dec)
+{
+    if (dec->is_static) return;
+    if (dec->window != NULL) mem_free(dec->window);
+    if (dec->entropy_buf != NULL) mem_free(dec->entropy_buf);
+}
+
+/* Create new decoder */
+struct ulz77_decoder *ulz77_decoder_new(void)
+{
+    struct ulz77_decoder *dec;
+
+    dec = (struct ulz77_decoder *)mem_alloc(sizeof(struct ulz77_decoder));
+    if (dec == NULL) return NULL;
+    decoder_init(dec);
+
+    return dec;
+}
+
+/* Bytes of window, and of streams and sequences of entropy coded blocks
+ * up to max_len bytes */
+static size_t decoder_workspace_parts(const struct ulz77_params *params, size_t max_len, size_t *window_size)
+{
+    size_t entropy_size = 0;
+
+    *window_size = WORKSPACE_ALIGN_UP(MAX(1U << params->window_log, BUFFER_SIZE));
+    if ((params->flags & ULZ77_FLAG_ENTROPY) != 0)
+        entropy_size = entropy_sequences_bound(max_len) * 2;
+
+    return WORKSPACE_ALIGN_UP(sizeof(struct ulz77_decoder)) + *window_size + entropy_size;
+}
+
+/* Bytes of workspace for a static decoder */
+size_t ulz77_decoder_workspace_size(const struct ulz77_params *params)
+{
+    if (params_check(params) != 0) return 0;
+    return ulz77_decoder_workspace_size_block(params, (size_t)1 << params->window_log);
+}
+
+/* Bytes of workspace for a static decoder of blocks up to max_len bytes */
+size_t ulz77_decoder_workspace_size_block(const struct ulz77_params *params, size_t max_len)
+{
+    size_t window_size;
+
+    if (params_check(params) != 0) return 0;
+    max_len = MAX(max_len, (size_t)1 << params->window_log);
+    if (max_len > (size_t)SIZE_MAX / 16) return 0;
+    return decoder_workspace_parts(params, max_len, &window_size) + WORKSPACE_ALIGN - 1;
+}
+
+/* Initialize decoder in workspace, the rest after the window takes the
+ * streams and sequences of entropy coded blocks */
+struct ulz77_decoder *ulz77_decoder_init_static(void *mem, size_t len, const struct ulz77_params *params)
+{
+    struct ulz77_decoder *dec;
+    unsigned char *mem_p, *mem_endp;
+    size_t window_size;
+
+    if ((mem == NULL) || (params_check(params) != 0)) return NULL;
+    if (len < ulz77_decoder_workspace_size(params)) return NULL;
+    decoder_workspace_parts(params, (size_t)1 << params->window_log, &window_size);
+
+    mem_endp = (unsigned char *)mem + len;
+    mem_p = (unsigned char *)mem + ((WORKSPACE_ALIGN - (uintptr_t)mem % WORKSPACE_ALIGN) % WORKSPACE_ALIGN);
+    dec = (struct ulz77_decoder *)mem_p;
+    mem_p += WORKSPACE_ALIGN_UP(sizeof(struct ulz77_decoder));
+    decoder_init(dec);
+    dec->is_static = 1;
+    dec->window = mem_p;
+    dec->window_capacity = (unsigned int)window_size;
+    mem_p += window_size;
+    dec->entropy_buf = mem_p;
+    dec->entropy_capacity = (size_t)(mem_endp - mem_p);
+
+    return dec;
+}
+
+/* Destroy decoder, a static one has nothing to free */
+int ulz77_decoder_destroy(struct ulz77_decoder *dec)
+{
+    if (dec == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (dec->is_static) return 0;
+    decoder_release(dec);
+    mem_free(dec);
+    return 0;
+}
+
+/* Set dictionary of decoder, which is checked against the ID in header */
+int ulz77_decoder_set_dict(struct ulz77_decoder *dec, const struct ulz77_dict *dict)
+{
+    if (dec == NULL) return -ULZ77_ERR_NULL_PTR;
+    dec->dict = dict;
+    return 0;
+}
+
+/* Reset decoder for data independent of what it decoded, buffers are kept */
+int ulz77_decoder_reset(struct ulz77_decoder *dec)
+{
+    if (dec == NULL) return -ULZ77_ERR_NULL_PTR;
+    dec->window_len = 0;
+    dec->window_size = BUFFER_SIZE;
+    dec->format = ULZ77_FORMAT_V1;
+    dec->head_remain = 0;
+    dec->content_size = 0;
+    dec->block_len = 0;
+    dec->flags = 0;
+    dec->dict_len = 0;
+    dec->sequence_stage = 0;
+    dec->match_remain = 0;
+    dec->src_p_interrupted = NULL;
+    dec->src_len = 0;
+    dec->dst_len = 0;
+    dec->src_total_len = 0;
+    dec->dst_total_len = 0;
+    return 0;
+}
+
+unsigned char *ulz77_decoder_get_previous(struct ulz77_decoder *dec)
+{
+    return dec->src_p_interrupted;
+}
+
+/* Copy a match from the output already written, source and destination
+ * may overlap when the distance is shorter than the length. 
+ * Up to 15 bytes after the match might be overwritten if the room
+ * before dst_endp allows. */
+static __inline void copy_match(unsigned char *dst_p, size_t distance, size_t len, unsigned char *dst_endp)
+{
+    const unsigned char *ref = dst_p - distance;
+    unsigned char *match_endp = dst_p + len;
+
+    if ((distance >= 16) && ((size_t)(dst_endp - match_endp) >= 16))
+    {
+        do
+        {
+            memcpy(dst_p, ref, 16);
+            dst_p += 16; ref += 16;
+        } while (dst_p < match_endp);
+    }
+    else if ((distance >= 8) && ((size_t)(dst_endp - match_endp) >= 8))
+    {
+        do
+        {
+            memcpy(dst_p, ref, 8);
+            dst_p += 8; ref += 8;
+        } while (dst_p < match_endp);
+    }
+    else
+    {
+        while (dst_p != match_endp) *dst_p++ = *ref++;
+    }
+}
+
+/* Grow window to take the window size twice, so that it slides once per
+ * window size of output at most */
+static int decoder_reserve_window(struct ulz77_decoder *dec)
+{
+    unsigned char *new_window;
+
+    if (dec->window_capacity >= dec->window_size * 2) return 0;
+    /* a static window of the window size slides on every turn */
+    if (dec->is_static) return (dec->window_capacity >= dec->window_size) ? 0 : -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    new_window = (unsigned char *)mem_realloc(dec->window, sizeof(unsigned char) * dec->window_size * 2);
+    if (new_window == NULL) return -ULZ77_ERR_MALLOC;
+    dec->window = new_window;
+    dec->window_capacity = dec->window_size * 2;
+    return 0;
+}
+
+/* Keep the tail of output of this turn as the window of the next turn,
+ * the window may hold more than the window size till it is full */
+static int decoder_keep_window(struct ulz77_decoder *dec, const unsigned char *out, size_t out_len)
+{
+    unsigned int keep;
+    int ret;
+
+    if ((ret = decoder_reserve_window(dec)) != 0) return ret;
+
+    if (out_len >= dec->window_size)
+    {
+        memcpy(dec->window, out + out_len - dec->window_size, dec->window_size);
+        dec->window_len = dec->window_size;
+        return 0;
+    }
+    if (dec->window_len + out_len > dec->window_capacity)
+    {
+        keep = MIN(dec->window_len, dec->window_size - (unsigned int)out_len);
+        memmove(dec->window, dec->window + dec->window_len - keep, keep);
+        dec->window_len = keep;
+    }
+    memcpy(dec->window + dec->window_len, out, out_len);
+    dec->window_len += (unsigned int)out_len;
+    return 0;
+}
+
+/* Copy the part of match starting in the dictionary, which is before the
+ * window of previous turns, the rest starts from the oldest byte after it */
+static __inline void decoder_copy_dict(const struct ulz77_decoder *dec, const unsigned char *dst, \
+        unsigned char **dst_pp, size_t distance, size_t *matched_len)
+{
+    size_t back = distance - dec->window_len - (size_t)(*dst_pp - dst);
+    size_t n = MIN(*matched_len, back);
+
+    memcpy(*dst_pp, dec->dict->content + dec->dict_len - back, n);
+    *dst_pp += n;
+    *matched_len -= n;
+}
+
+/* Copy a match from the dictionary, the window of previous turns and the
+ * output of this turn, in that order */
+static __inline void decoder_copy_match(const struct ulz77_decoder *dec, unsigned char *dst, size_t dst_buffer_size, \
+        unsigned char **dst_pp, size_t distance, size_t matched_len)
+{
+    unsigned char *dst_p = *dst_pp;
+    size_t n;
+
+    if (distance > dec->window_len + (size_t)(dst_p - dst))
+        decoder_copy_dict(dec, dst, &dst_p, distance, &matched_len);
+    if ((matched_len != 0) && (distance > (size_t)(dst_p - dst)))
+    {
+        /* starts in the window of previous turns */
+        n = MIN(matched_len, distance - (size_t)(dst_p - dst));
+        memcpy(dst_p, dec->window + dec->window_len - (distance - (size_t)(dst_p - dst)), n);
+        dst_p += n;
+        matched_len -= n;
+    }
+    if (matched_len != 0)
+    {
+        copy_match(dst_p, distance, matched_len, dst + dst_buffer_size);
+        dst_p += matched_len;
+    }
+    *dst_pp = dst_p;
+}
+
+/* Copy as much of a match as dst takes, the rest is kept in decoder for
+ * the next turn, return -ULZ77_ERR_BUFFER_FULL if there is a rest */
+static __inline int decoder_put_match(struct ulz77_decoder *dec, unsigned char *dst, size_t dst_buffer_size, \
+        unsigned char **dst_pp, unsigned char *dst_endp, size_t distance, size_t matched_len)
+{
+    size_t n = MIN(matched_len, (size_t)(dst_endp - *dst_pp));
+
+    decoder_copy_match(dec, dst, dst_buffer_size, dst_pp, distance, n);
+    dec->match_distance = distance;
+    dec->match_remain = matched_len - n;
+    return (dec->match_remain != 0) ? -ULZ77_ERR_BUFFER_FULL : 0;
+}
+
+/* Start decoding a block, parse the header if there is */
+static int decoder_begin(struct ulz77_decoder *dec, const unsigned char *src, size_t len)
+{
+    struct ulz77_header header;
+    int ret;
+
+    if ((ret = parse_header(src, len, &header)) != 0) return ret;
+
+    dec->format = header.format;
+    if (header.format == ULZ77_FORMAT_V1)
+    {
+        /* v1 blocks were decoded on the window of previous ones */
+        dec->window_size = BUFFER_SIZE;
+        /* the first 3 bytes are raw */
+        dec->head_remain = 3;
+    }
+    else
+    {
+        dec->window_size = 1U << header.window_log;
+        /* a linked block goes on from the window of the previous one */
+        if ((header.flags & ULZ77_FLAG_LINKED) == 0) dec->window_len = 0;
+        dec->head_remain = 0;
+    }
+    dec->content_size = header.content_size;
+    dec->block_len = 0;
+    dec->flags = header.flags;
+    dec->dict_len = 0;
+    if ((header.flags & ULZ77_FLAG_DICT) != 0)
+    {
+        if ((dec->dict == NULL) || (dec->dict->id != header.dict_id)) return -ULZ77_ERR_DICT;
+        dec->dict_len = dec->dict->len;
+    }
+    dec->sequence_stage = 0;
+    dec->match_remain = 0;
+    if (((dec->flags & ULZ77_FLAG_ENTROPY) != 0) && ((dec->flags & ULZ77_FLAG_SEQUENCE) == 0))
+        return -ULZ77_ERR_INVALID_DATA;
+
+    return (int)header.header_len;
+}
+
+/* Read a match token of format v2 following the sentinel,
+ * return NULL if the token is broken or truncated */
+static __inline const unsigned char *read_match(const unsigned char *src_p, const unsigned char *src_endp, \
+        size_t window_size, size_t *distance, size_t *matched_len)
+{
+    unsigned int token = *src_p++;
+    uint64_t value;
+
+    if ((token >> 4) == 0) return NULL;
+
+    *distance = token & 0x7;
+    if ((token & 0x8) != 0)
+    {
+        src_p = read_varint(src_p, src_endp, 4, &value);
+        if ((src_p == NULL) || (value >= window_size)) return NULL;
+        *distance |= (size_t)value << 3;
+    }
+    *distance += 1;
+
+    *matched_len = (token >> 4) + 3;
+    if (*matched_len == 18)
+    {
+        src_p = read_varint(src_p, src_endp, 3, &value);
+        if ((src_p == NULL) || (value > MATCH_LEN_LIMIT - 18)) return NULL;
+        *matched_len += (size_t)value;
+    }
+    return src_p;
+}
+
+/* Decode sequences till the end of src, the sequence interrupted is
+ * kept in decoder. Unless last, src_endp is not the end of block, and a
+ * token is decoded only if FEED_TOKEN_MAX bytes are there.
+ * Return -ULZ77_ERR_BUFFER_FULL if the dst buffer is full */
+static int decoder_decode_sequences(struct ulz77_decoder *dec, \
+        unsigned char *dst, size_t dst_buffer_size, unsigned char **dst_pp, unsigned char *dst_endp, \
+        const unsigned char **src_pp, const unsigned char *src_endp, int last)
+{
+    int ret = 0;
+    unsigned char *dst_p = *dst_pp;
+    const unsigned char *src_p = *src_pp, *token_p, *match_p;
+    uint64_t value;
+    size_t distance, matched_len, n;
+
+    for (;;)
+    {
+        if (dec->sequence_stage == 0)
+        {
+            /* token */
+            if ((src_p == src_endp) || ((!last) && (src_endp - src_p < FEED_TOKEN_MAX))) break;
+            token_p = src_p;
+            dec->match_bits = *src_p & 0xF;
+            dec->literal_remain = *src_p++ >> 4;
+            if (dec->literal_remain == 15)
+            {
+                /* literals of the last input are all in src */
+                src_p = read_varint(src_p, src_endp, 10, &value);
+                if ((src_p == NULL) || (value > (last ? (uint64_t)(src_endp - src_p) : dec->content_size)))
+                {
+                    src_p = token_p;
+                    ret = -ULZ77_ERR_INVALID_DATA;
+                    break;
+                }
+                dec->literal_remain += value;
+            }
+            dec->sequence_stage = 1;
+        }
+
+        if (dec->sequence_stage == 1)
+        {
+            /* literals, copied in bulk */
+            n = (size_t)MIN(dec->literal_remain, (uint64_t)(src_endp - src_p));
+            if (n > (size_t)(dst_endp - dst_p))
+            {
+                n = (size_t)(dst_endp - dst_p);
+                memcpy(dst_p, src_p, n);
+                dst_p += n; src_p += n;
+                dec->literal_remain -= n;
+                ret = -ULZ77_ERR_BUFFER_FULL;
+                break;
+            }
+            memcpy(dst_p, src_p, n);
+            dst_p += n; src_p += n;
+            dec->literal_remain -= n;
+            if (dec->literal_remain != 0)
+            {
+                /* the rest comes with more input */
+                if (last) ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            dec->sequence_stage = 2;
+        }
+
+        /* match, the last sequence might end with literals */
+        if (src_p == src_endp)
+        {
+            if (!last) break;
+            if (dec->match_bits != 0) ret = -ULZ77_ERR_INVALID_DATA;
+            dec->sequence_stage = 0;
+            break;
+        }
+        if ((!last) && (src_endp - src_p < FEED_TOKEN_MAX)) break;
+        match_p = src_p;
+        src_p = read_varint(src_p, src_endp, 4, &value);
+        if ((src_p == NULL) || (value > dec->window_size))
+        {
+            src_p = match_p;
+            ret = -ULZ77_ERR_INVALID_DATA;
+            break;
+        }
+        distance = (size_t)value;
+        matched_len = dec->match_bits + MATCH_LEN_MIN;
+        if (distance == 0)
+        {
+            /* literals only */
+            if (dec->match_bits != 0)
+            {
+                src_p = match_p;
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            dec->sequence_stage = 0;
+            continue;
+        }
+        if (dec->match_bits == 15)
+        {
+            src_p = read_varint(src_p, src_endp, 3, &value);
+            if ((src_p == NULL) || (value > MATCH_LEN_LIMIT - 19))
+            {
+                src_p = match_p;
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            matched_len += (size_t)value;
+        }
+        if (distance > MIN(dec->dict_len + dec->window_len + (size_t)(dst_p - dst), dec->window_size))
+        {
+            src_p = match_p;
+            ret = -ULZ77_ERR_INVALID_DATA;
+            break;
+        }
+        /* a match longer than the rest of dst goes on in the next turn */
+        dec->sequence_stage = 0;
+        ret = decoder_put_match(dec, dst, dst_buffer_size, &dst_p, dst_endp, distance, matched_len);
+        if (ret != 0) break;
+    }
+
+    *dst_pp = dst_p;
+    *src_pp = src_p;
+    return ret;
+}
+
+/* Decode literals and sentinel tokens of format v1 and v2 till the end of
+ * src, with the same rules of input and output as sequences */
+static int decoder_decode_tokens(struct ulz77_decoder *dec, \
+        unsigned char *dst, size_t dst_buffer_size, unsigned char **dst_pp, unsigned char *dst_endp, \
+        const unsigned char **src_pp, const unsigned char *src_endp, int last)
+{
+    int ret = 0;
+    unsigned char *dst_p = *dst_pp;
+    const unsigned char *src_p = *src_pp, *token_p, *run_endp;
+    size_t matched_pos, matched_len, distance, grow, n;
+
+    while (src_p != src_endp)
+    {
+        if (*src_p != SENTINEL)
+        {
+            /* copy literals till the next sentinel in bulk */
+            run_endp = (const unsigned char *)memchr(src_p, SENTINEL, (size_t)(src_endp - src_p));
+            if (run_endp == NULL) run_endp = src_endp;
+            n = (size_t)(run_endp - src_p);
+            if (n > (size_t)(dst_endp - dst_p))
+            {
+                n = (size_t)(dst_endp - dst_p);
+                memcpy(dst_p, src_p, n);
+                dst_p += n; src_p += n;
+                ret = -ULZ77_ERR_BUFFER_FULL;
+                break;
+            }
+            memcpy(dst_p, src_p, n);
+            dst_p += n; src_p += n;
+            continue;
+        }
+        if ((!last) && (src_endp - src_p < FEED_TOKEN_MAX)) break;
+
+        /* matched */
+        token_p = src_p;
+        if (dec->format == ULZ77_FORMAT_V2)
+        {
+            if (src_endp - src_p < 2)
+            {
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            if (src_p[1] == 0)
+            {
+                /* escaped sentinel */
+                if (dst_p == dst_endp)
+                {
+                    ret = -ULZ77_ERR_BUFFER_FULL;
+                    break;
+                }
+                *dst_p++ = SENTINEL;
+                src_p += 2;
+                continue;
+            }
+            src_p = read_match(src_p + 1, src_endp, dec->window_size, &distance, &matched_len);
+            if (src_p == NULL)
+            {
+                src_p = token_p;
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+        }
+        else
+        {
+            if (src_endp - src_p < 3)
+            {
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            matched_len = ((src_p[1] >> 4) & 0xF) + 3;
+            matched_pos = ((size_t)(src_p[1] & 0xF) << 8) | src_p[2];
+            src_p += 3;
+            if (matched_len == 3 && matched_pos == 0)
+            {
+                /* escaped sentinel */
+                if (dst_p == dst_endp)
+                {
+                    src_p = token_p;
+                    ret = -ULZ77_ERR_BUFFER_FULL;
+                    break;
+                }
+                *dst_p++ = SENTINEL;
+                continue;
+            }
+            if (matched_len == 18)
+            {
+                if ((src_p != src_endp) && ((*src_p & 0x80) == 0))
+                {
+                    matched_len = 17 + (*src_p & 127);
+                    src_p++;
+                }
+                else if ((src_endp - src_p >= 2) && ((*(src_p + 1) & 0x80) == 0))
+                {
+                    matched_len = 17 + (((*(src_p + 1) & 127) << 7) | (*src_p & 127));
+                    src_p += 2;
+                }
+                else
+                {
+                    src_p = token_p;
+                    ret = -ULZ77_ERR_INVALID_DATA;
+                    break;
+                }
+            }
+
+            /* position is relative to the beginning of window */
+            grow = MIN(dec->window_len + (size_t)(dst_p - dst), dec->window_size);
+            if (matched_pos >= grow)
+            {
+                src_p = token_p;
+                ret = -ULZ77_ERR_INVALID_DATA;
+                break;
+            }
+            distance = grow - matched_pos;
+        }
+        if (distance > MIN(dec->dict_len + dec->window_len + (size_t)(dst_p - dst), dec->window_size))
+        {
+            src_p = token_p;
+            ret = -ULZ77_ERR_INVALID_DATA;
+            break;
+        }
+        /* a match longer than the rest of dst goes on in the next turn */
+        ret = decoder_put_match(dec, dst, dst_buffer_size, &dst_p, dst_endp, distance, matched_len);
+        if (ret != 0) break;
+    }
+
+    *dst_pp = dst_p;
+    *src_pp = src_p;
+    return ret;
+}
+
+/* Decode the body of block from src into dst after dst_p, going on from
+ * the raw head, the match or the sequence interrupted in the last turn.
+ * Bytes of dst before dst_p follow the window of previous turns */
+static int decoder_decode_body(struct ulz77_decoder *dec, \
+        unsigned char *dst, size_t dst_buffer_size, unsigned char **dst_pp, unsigned char *dst_endp, \
+        const unsigned char **src_pp, const unsigned char *src_endp, int last)
+{
+    int ret = 0;
+
+    while ((dec->head_remain != 0) && (*src_pp != src_endp))
+    {
+        if (*dst_pp == dst_endp) return -ULZ77_ERR_BUFFER_FULL;
+        *(*dst_pp)++ = *(*src_pp)++;
+        dec->head_remain--;
+    }
+    if ((dec->match_remain != 0) && \
+            ((ret = decoder_put_match(dec, dst, dst_buffer_size, dst_pp, dst_endp, dec->match_distance, dec->match_remain)) != 0))
+        return ret;
+
+    if ((dec->flags & ULZ77_FLAG_SEQUENCE) != 0)
+        return decoder_decode_sequences(dec, dst, dst_buffer_size, dst_pp, dst_endp, src_pp, src_endp, last);
+    return decoder_decode_tokens(dec, dst, dst_buffer_size, dst_pp, dst_endp, src_pp, src_endp, last);
+}
+
+/* Decode the streams of entropy coded block and put them back into
+ * sequences, which are decoded in the following turns */
+static int decoder_entropy_begin(struct ulz77_decoder *dec, const unsigned char *src_p, const unsigned char *src_endp)
+{
+    struct entropy_stream streams[STREAM_COUNT];
+    unsigned char *token_p, *token_endp, *literal_p, *literal_endp, *extra_p, *extra_endp;
+    unsigned char *seq_p, *new_buffer;
+    const unsigned char *varint_p;
+    uint64_t literal_len, distance, value;
+    size_t total = 0;
+    unsigned int token, i;
+
+    for (i = 0; i < STREAM_COUNT; i++)
+    {
+        if ((src_p = read_stream(src_p, src_endp, &streams[i])) == NULL) return -ULZ77_ERR_INVALID_DATA;
+        if (streams[i].raw_size > entropy_sequences_bound(dec->content_size) - total) return -ULZ77_ERR_INVALID_DATA;
+        total += streams[i].raw_size;
+    }
+    if (src_p != src_endp) return -ULZ77_ERR_INVALID_DATA;
+
+    /* streams, then the sequences */
+    if ((dec->entropy_buf == NULL) || (dec->entropy_capacity < total * 2))
+    {
+        if (dec->is_static) return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+        new_buffer = (unsigned char *)mem_realloc(dec->entropy_buf, MAX(total * 2, 1));
+        if (new_buffer == NULL) return -ULZ77_ERR_MALLOC;
+        dec->entropy_buf = new_buffer;
+        dec->entropy_capacity = MAX(total * 2, 1);
+    }
+    token_p = dec->entropy_buf;
+    for (i = 0; i < STREAM_COUNT; i++)
+    {
+        if (decode_stream(&streams[i], token_p) != 0) return -ULZ77_ERR_INVALID_DATA;
+        token_p += streams[i].raw_size;
+    }
+    token_p = dec->entropy_buf;
+    token_endp = literal_p = token_p + streams[0].raw_size;
+    literal_endp = extra_p = literal_p + streams[1].raw_size;
+    extra_endp = extra_p + streams[2].raw_size;
+
+    seq_p = dec->entropy_buf + total;
+    while (token_p != token_endp)
+    {
+        token = *seq_p++ = *token_p++;
+        literal_len = token >> 4;
+        if (literal_len == 15)
+        {
+            varint_p = extra_p;
+            if ((extra_p = (unsigned char *)read_varint(extra_p, extra_endp, 10, &value)) == NULL) return -ULZ77_ERR_INVALID_DATA;
+            memcpy(seq_p, varint_p, (size_t)(extra_p - varint_p));
+            seq_p += extra_p - varint_p;
+            literal_len += value;
+        }
+        if (literal_len > (uint64_t)(literal_endp - literal_p)) return -ULZ77_ERR_INVALID_DATA;
+        memcpy(seq_p, literal_p, (size_t)literal_len);
+        seq_p += literal_len;
+        literal_p += literal_len;
+
+        /* the last sequence might end with literals */
+        if ((token_p == token_endp) && (extra_p == extra_endp)) break;
+        varint_p = extra_p;
+        if ((extra_p = (unsigned char *)read_varint(extra_p, extra_endp, 4, &distance)) == NULL) return -ULZ77_ERR_INVALID_DATA;
+        if ((distance != 0) && ((token & 0xF) == 15))
+        {
+            if ((extra_p = (unsigned char *)read_varint(extra_p, extra_endp, 3, &value)) == NULL) return -ULZ77_ERR_INVALID_DATA;
+        }
+        memcpy(seq_p, varint_p, (size_t)(extra_p - varint_p));
+        seq_p += extra_p - varint_p;
+    }
+    if ((literal_p != literal_endp) || (extra_p != extra_endp)) return -ULZ77_ERR_INVALID_DATA;
+
+    dec->entropy_p = dec->entropy_buf + total;
+    dec->entropy_endp = seq_p;
+    return 0;
+}
+
+/* Decode data, a call which is not a continuation of an interrupted
+ * one starts a new block */
+int ulz77_decoder_decode(struct ulz77_decoder *dec, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len)
+{
+    int ret = 0;
+    unsigned char *dst_p = dst, *dst_endp = dst + dst_buffer_size;
+    unsigned char *src_p = src, *src_endp = src + len;
+    const unsigned char *in_p;
+    int bounded = 0; /* output is limited by the content size rather than the buffer */
+
+    if (dec->src_p_interrupted == NULL)
+    {
+        ret = decoder_begin(dec, src, len);
+        if (ret < 0)
+        {
+            dst_p = dst;
+            goto done;
+        }
+        src_p += ret;
+        ret = 0;
+        if ((dec->flags & ULZ77_FLAG_ENTROPY) != 0)
+        {
+            ret = decoder_entropy_begin(dec, src_p, src_endp);
+            if (ret != 0) goto done;
+        }
+    }
+    if ((dec->format == ULZ77_FORMAT_V2) && (dec->content_size - dec->block_len <= dst_buffer_size))
+    {
+        dst_endp = dst + (size_t)(dec->content_size - dec->block_len);
+        bounded = 1;
+    }
+
+    if ((dec->flags & ULZ77_FLAG_ENTROPY) != 0)
+    {
+        /* sequences are kept in decoder, src is all taken */
+        src_p = src_endp;
+        in_p = dec->entropy_p;
+        ret = decoder_decode_body(dec, dst, dst_buffer_size, &dst_p, dst_endp, &in_p, dec->entropy_endp, 1);
+        dec->entropy_p = (unsigned char *)in_p;
+    }
+    else
+    {
+        in_p = src_p;
+        ret = decoder_decode_body(dec, dst, dst_buffer_size, &dst_p, dst_endp, &in_p, src_endp, 1);
+        src_p = (unsigned char *)in_p;
+    }
+    if (ret == -ULZ77_ERR_BUFFER_FULL) goto full;
+    if (ret != 0) goto done;
+
+    /* the block must end exactly at the content size */
+    if ((dec->format == ULZ77_FORMAT_V2) && (dec->block_len + (size_t)(dst_p - dst) != dec->content_size))
+    {
+        ret = -ULZ77_ERR_INVALID_DATA;
+        goto done;
+    }
+    if ((dec->format == ULZ77_FORMAT_V1) || (dec->keep_window != 0))
+        ret = decoder_keep_window(dec, dst, (size_t)(dst_p - dst));
+    goto done;
+full:
+    if (bounded)
+    {
+        /* more output than the content size */
+        ret = -ULZ77_ERR_INVALID_DATA;
+        goto done;
+    }
+    dec->src_p_interrupted = src_p;
+    ret = decoder_keep_window(dec, dst, (size_t)(dst_p - dst));
+    if (ret == 0) ret = -ULZ77_ERR_BUFFER_FULL;
+done:
+    /* the next call starts a new block unless interrupted */
+    if (ret != -ULZ77_ERR_BUFFER_FULL) dec->src_p_interrupted = NULL;
+    dec->src_len = src_p - src;
+    dec->dst_len = dst_p - dst;
+    dec->block_len += dec->dst_len;
+    dec->src_total_len += dec->src_len;
+    dec->dst_total_len += dec->dst_len;
+
+    return ret;
+}
+
+#define ULZ77_TYPE_COMPRESSION 0
+#define ULZ77_TYPE_DECOMPRESSION 1
+
+/* Encode data */
+int ulz77_encode_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, int type, const struct ulz77_params *params)
+{
+    int ret = 0;
+    struct ulz77_encoder *enc = NULL;
+    struct ulz77_decoder *dec = NULL;
+
+    /* src */
+    unsigned char *src_p;
+    size_t task_len;
+
+    /* dst */
+    unsigned char *dst = NULL, *dst_p;
+    size_t dst_buffer_size;
+    size_t dst_buffer_remain_size;
+    size_t dst_total_len;
+    unsigned char *new_buffer = NULL;
+    struct ulz77_header header;
+
+    if (src == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    *dst_out = NULL;
+    *dst_out_len = 0;
+
+    /* Create destination buffer, compressed size is bounded and
+     * decompressed size of v2 is known */
+    dst_buffer_size = MAX(src_len * 3, BUFFER_SIZE);
+    if (type == ULZ77_TYPE_COMPRESSION)
+    {
+        dst_buffer_size = ulz77_compress_bound(src_len);
+    }
+    else if ((type == ULZ77_TYPE_DECOMPRESSION) && (parse_header(src, src_len, &header) == 0) && \
+            (header.format == ULZ77_FORMAT_V2) && (header.content_size <= (uint64_t)SIZE_MAX / 2))
+    {
+        dst_buffer_size = MAX((size_t)header.content_size, 1);
+    }
+    dst_buffer_remain_size = dst_buffer_size;
+    dst = (unsigned char *)mem_alloc(sizeof(unsigned char) * (dst_buffer_size));
+    if (dst == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto done;
+    }
+
+    /* Create encoder or decoder */
+    if (type == ULZ77_TYPE_COMPRESSION)
+    {
+        if ((ret = params_check(params)) != 0) goto done;
+        enc = ulz77_encoder_new_params(params);
+        if (enc == NULL)
+        {
+            ret = -ULZ77_ERR_MALLOC;
+            goto done;
+        }
+    }
+    else if (type == ULZ77_TYPE_DECOMPRESSION)
+    {
+        dec = ulz77_decoder_new();
+        if (dec == NULL)
+        {
+            ret = -ULZ77_ERR_MALLOC;
+            goto done;
+        }
+        /* one block, nothing follows it */
+        dec->keep_window = 0;
+        if (params != NULL) dec->dict = params->dict;
+    }
+    else
+    {
+        ret = -ULZ77_ERR_UNKNOWN_OP;
+        goto done;
+    }
+
+    src_p = src;
+    dst_p = dst;
+    task_len = src_len;
+    for (;;)
+    {
+        if (enc != NULL)
+        {
+            ret = ulz77_encoder_encode(enc, dst_p, dst_buffer_remain_size, src_p, task_len);
+            dst_total_len = enc->dst_total_len;
+        }
+        else
+        {
+            ret = ulz77_decoder_decode(dec, dst_p, dst_buffer_remain_size, src_p, task_len);
+            dst_total_len = dec->dst_total_len;
+        }
+        if (ret == 0)
+        {
+            *dst_out = dst;
+            *dst_out_len = dst_total_len;
+            dst = NULL;
+            ret = 0;
+            goto done;
+        }
+        else if (ret == -ULZ77_ERR_BUFFER_FULL)
+        {
+            /* extend buffer */
+            dst_buffer_size <<= 1;
+            new_buffer = (unsigned char *)mem_alloc(sizeof(unsigned char) * dst_buffer_size);
+            if (new_buffer == NULL)
+            {
+                ret = -ULZ77_ERR_MALLOC;
+                goto done;
+            }
+            memcpy(new_buffer, dst, dst_total_len);
+            mem_free(dst);dst = new_buffer;new_buffer = NULL;
+            dst_buffer_remain_size = dst_buffer_size - dst_total_len;
+            if (enc != NULL)
+            {
+                task_len -= enc->src_len;
+                src_p = ulz77_encoder_get_previous(enc);
+            }
+            else
+            {
+                task_len -= dec->src_len;
+                src_p = ulz77_decoder_get_previous(dec);
+            }
+            dst_p = dst + dst_total_len;
+        }
+        else
+        {
+            goto done;
+        }
+    }
+done:
+    if (dst != NULL) mem_free(dst);
+    if (enc != NULL) ulz77_encoder_destroy(enc);
+    if (dec != NULL) ulz77_decoder_destroy(dec);
+    return ret;
+}
+
+/* Worst case of compressed size, 0 if len is too large */
+size_t ulz77_compress_bound(size_t len)
+{
+    /* An escaped sentinel of the byte layout takes 2 bytes, which is
+     * the most a byte takes in any layout, sequences never take more
+     * either. Entropy coded block adds 3 raw stream headers, which also
+     * covers the reserved bytes the encoder keeps before the end. */
+    size_t extra = ULZ77_HEADER_SIZE_MAX + STREAM_RAW_HEADER_SIZE_MAX * STREAM_COUNT;
+
+    if (len > (SIZE_MAX - extra) / 2) return 0;
+    return len * 2 + extra;
+}
+
+/* Compress data into dst of dst_cap bytes in one pass */
+int ulz77_compress_into(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len, const struct ulz77_params *params)
+{
+    struct ulz77_params default_params;
+    struct ulz77_encoder *enc;
+    int ret;
+
+    if ((dst == NULL) || (dst_len == NULL) || ((src == NULL) && (src_len != 0))) return -ULZ77_ERR_NULL_PTR;
+    *dst_len = 0;
+    if (params == NULL)
+    {
+        ulz77_params_init(&default_params);
+        params = &default_params;
+    }
+    if ((ret = params_check(params)) != 0) return ret;
+
+    enc = ulz77_encoder_new_params(params);
+    if (enc == NULL) return -ULZ77_ERR_MALLOC;
+    ret = ulz77_encoder_encode(enc, dst, dst_cap, src, src_len);
+    /* not resumed, dst must hold all */
+    if (ret == -ULZ77_ERR_BUFFER_FULL) ret = -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    if (ret == 0) *dst_len = enc->dst_total_len;
+    ulz77_encoder_destroy(enc);
+
+    return ret;
+}
+
+/* Get decompressed size from header */
+int ulz77_content_size(const unsigned char *src, size_t src_len, uint64_t *content_size)
+{
+    struct ulz77_header header;
+    int ret;
+
+    if ((src == NULL) || (content_size == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if ((ret = parse_header(src, src_len, &header)) != 0) return ret;
+    /* v1 has no header */
+    if (header.format == ULZ77_FORMAT_V1) return -ULZ77_ERR_INVALID_DATA;
+    *content_size = header.content_size;
+
+    return 0;
+}
+
+/* Decompress data into dst of dst_cap bytes in one pass */
+int ulz77_decompress_into(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len)
+{
+    return ulz77_decompress_into_dict(dst, dst_cap, dst_len, src, src_len, NULL);
+}
+
+/* Decompress data compressed with dictionary into dst of dst_cap bytes */
+int ulz77_decompress_into_dict(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len, const struct ulz77_dict *dict)
+{
+    struct ulz77_decoder dec;
+    struct ulz77_header header;
+    int ret;
+
+    if ((dst_len == NULL) || (src == NULL) || ((dst == NULL) && (dst_cap != 0))) return -ULZ77_ERR_NULL_PTR;
+    *dst_len = 0;
+
+    /* fail before decoding, which keeps a window when interrupted */
+    if ((ret = parse_header(src, src_len, &header)) != 0) return ret;
+    if ((header.format == ULZ77_FORMAT_V2) && (header.content_size > (uint64_t)dst_cap))
+        return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+
+    decoder_init(&dec);
+    dec.keep_window = 0;
+    dec.dict = dict;
+    ret = ulz77_decoder_decode(&dec, dst, dst_cap, src, src_len);
+    if (ret == -ULZ77_ERR_BUFFER_FULL) ret = -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    if (ret == 0) *dst_len = dec.dst_total_len;
+    decoder_release(&dec);
+
+    return ret;
+}
+
+/* Compress data */
+int ulz77_compress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len)
+{
+    return ulz77_compress_data_level(dst_out, dst_out_len, src, src_len, ULZ77_LEVEL_DEFAULT);
+}
+
+/* Compress data with specified compression level */
+int ulz77_compress_data_level(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, int level)
+{
+    struct ulz77_params params;
+
+    ulz77_params_init(&params);
+    params.level = level;
+    return ulz77_encode_data(dst_out, dst_out_len, src, src_len, ULZ77_TYPE_COMPRESSION, &params);
+}
+
+/* Compress data with specified parameters */
+int ulz77_compress_data_params(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, const struct ulz77_params *params)
+{
+    return ulz77_encode_data(dst_out, dst_out_len, src, src_len, ULZ77_TYPE_COMPRESSION, params);
+}
+
+/* Decompress data */
+int ulz77_decompress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len)
+{
+    return ulz77_encode_data(dst_out, dst_out_len, src, src_len, ULZ77_TYPE_DECOMPRESSION, NULL);
+}
+
+/* Encode file */
+int ulz77_encode_file(const char *filename_dst, const char *filename_src, int type, const struct ulz77_params *params)
+{
+    int ret = 0;
+    FILE *fp_src = NULL, *fp_dst = NULL;
+
+    /* src */
+    unsigned char *src = NULL;
+    size_t src_len;
+
+    /* dst */
+    unsigned char *dst = NULL;
+    size_t dst_len;
+
+    /* Open files */
+    fp_src = fopen(filename_src, "rb");
+    if (fp_src == NULL)
+    {
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto done;
+    }
+
+    /* Get source file length */
+    fseek(fp_src, 0, SEEK_END);
+    src_len = ftell(fp_src);
+    fseek(fp_src, 0, SEEK_SET);
+
+    /* Allocate space for source */
+    src = (unsigned char *)mem_alloc(sizeof(unsigned char) * MAX(src_len, 1));
+    if (src == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto done;
+    }
+
+    if ((src_len != 0) && (fread(src, src_len, 1, fp_src) < 1)) 
+    {
+        ret = -ULZ77_ERR_FILE_READ;
+        goto done;
+    }
+
+    ret = ulz77_encode_data(&dst, &dst_len, src, src_len, type, params);
+    if (ret == 0)
     {
         fp_dst = fopen(filename_dst, "wb+");
         if (fp_dst == NULL)
         {
-            ret = -ULZ77_ERR_FILE_OPEN;
+            ret = -ULZ77_ERR_FILE_OPEN;
+            goto done;
+        }
+        fwrite(dst, dst_len, 1, fp_dst);
+    }
+
+done:
+    if (src != NULL) mem_free(src);
+    if (dst != NULL) mem_free(dst);
+    if (fp_src != NULL) fclose(fp_src);
+    if (fp_dst != NULL) fclose(fp_dst);
+
+    return ret;
+}
+
+/* Map file of len bytes, an empty file gives a pointer to no byte */
+#ifdef ULZ77_POSIX
+static unsigned char *map_file(int fd, size_t len, int prot)
+{
+    static unsigned char empty[1];
+    void *addr;
+
+    if (len == 0) return empty;
+    addr = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return NULL;
+    /* both are passed once from the beginning */
+    madvise(addr, len, MADV_SEQUENTIAL);
+
+    return (unsigned char *)addr;
+}
+
+static void unmap_file(unsigned char *addr, size_t len)
+{
+    if ((addr != NULL) && (len != 0)) munmap(addr, len);
+}
+#endif
+
+/* Encode file through memory mapping, the encoder or decoder works on
+ * the mapped source and destination without copies */
+int ulz77_encode_file_mmap(const char *filename_dst, const char *filename_src, int type, const struct ulz77_params *params)
+{
+#ifdef ULZ77_POSIX
+    int ret = 0;
+    int fd_src = -1, fd_dst = -1;
+    struct stat st;
+    struct ulz77_encoder *enc = NULL;
+    struct ulz77_decoder *dec = NULL;
+    struct ulz77_header header;
+
+    /* src */
+    unsigned char *src = NULL;
+    size_t src_len = 0;
+
+    /* dst */
+    unsigned char *dst = NULL;
+    size_t dst_buffer_size = 0, dst_len = 0;
+
+    /* Map source */
+    fd_src = open(filename_src, O_RDONLY);
+    if ((fd_src < 0) || (fstat(fd_src, &st) != 0))
+    {
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto done;
+    }
+    src_len = (size_t)st.st_size;
+    src = map_file(fd_src, src_len, PROT_READ);
+    if (src == NULL)
+    {
+        ret = -ULZ77_ERR_FILE_READ;
+        goto done;
+    }
+
+    /* Size of destination, decompressed size of v1 is unknown */
+    if (type == ULZ77_TYPE_COMPRESSION)
+    {
+        if ((ret = params_check(params)) != 0) goto done;
+        dst_buffer_size = ulz77_compress_bound(src_len);
+    }
+    else if (type == ULZ77_TYPE_DECOMPRESSION)
+    {
+        if ((ret = parse_header(src, src_len, &header)) != 0) goto done;
+        if (header.format == ULZ77_FORMAT_V1)
+        {
+            unmap_file(src, src_len);
+            close(fd_src);
+            return ulz77_encode_file(filename_dst, filename_src, type, params);
+        }
+        if (header.content_size > (uint64_t)SIZE_MAX / 2)
+        {
+            ret = -ULZ77_ERR_INVALID_DATA;
+            goto done;
+        }
+        dst_buffer_size = (size_t)header.content_size;
+    }
+    else
+    {
+        ret = -ULZ77_ERR_UNKNOWN_OP;
+        goto done;
+    }
+
+    /* Map destination, the unwritten tail is truncated at last */
+    fd_dst = open(filename_dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_dst < 0)
+    {
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto done;
+    }
+    if ((ftruncate(fd_dst, (off_t)dst_buffer_size) != 0) || \
+            ((dst = map_file(fd_dst, dst_buffer_size, PROT_READ | PROT_WRITE)) == NULL))
+    {
+        ret = -ULZ77_ERR_FILE_WRITE;
+        goto done;
+    }
+
+    if (type == ULZ77_TYPE_COMPRESSION)
+    {
+        enc = ulz77_encoder_new_params(params);
+        if (enc == NULL)
+        {
+            ret = -ULZ77_ERR_MALLOC;
+            goto done;
+        }
+        /* bound leaves room for all */
+        ret = ulz77_encoder_encode(enc, dst, dst_buffer_size, src, src_len);
+        if (ret == -ULZ77_ERR_BUFFER_FULL) ret = -ULZ77_ERR_UNKNOWN;
+        dst_len = enc->dst_total_len;
+    }
+    else
+    {
+        dec = ulz77_decoder_new();
+        if (dec == NULL)
+        {
+            ret = -ULZ77_ERR_MALLOC;
+            goto done;
+        }
+        dec->keep_window = 0;
+        if (params != NULL) dec->dict = params->dict;
+        ret = ulz77_decoder_decode(dec, dst, MAX(dst_buffer_size, 1), src, src_len);
+        dst_len = dec->dst_total_len;
+        if ((ret == 0) && (dst_len != dst_buffer_size)) ret = -ULZ77_ERR_INVALID_DATA;
+    }
+    if (ret != 0) goto done;
+
+    unmap_file(dst, dst_buffer_size);
+    dst = NULL;
+    if (ftruncate(fd_dst, (off_t)dst_len) != 0) ret = -ULZ77_ERR_FILE_WRITE;
+
+done:
+    if (enc != NULL) ulz77_encoder_destroy(enc);
+    if (dec != NULL) ulz77_decoder_destroy(dec);
+    unmap_file(dst, dst_buffer_size);
+    unmap_file(src, src_len);
+    if (fd_src >= 0) close(fd_src);
+    if ((fd_dst >= 0) && (close(fd_dst) != 0) && (ret == 0)) ret = -ULZ77_ERR_FILE_WRITE;
+
+    return ret;
+#else
+    /* no memory mapping */
+    return ulz77_encode_file(filename_dst, filename_src, type, params);
+#endif
+}
+
+/* Compress file */
+int ulz77_compress_file(const char *filename_dst, const char *filename_src)
+{
+    return ulz77_compress_file_level(filename_dst, filename_src, ULZ77_LEVEL_DEFAULT);
+}
+
+/* Compress file with specified compression level */
+int ulz77_compress_file_level(const char *filename_dst, const char *filename_src, int level)
+{
+    struct ulz77_params params;
+
+    ulz77_params_init(&params);
+    params.level = level;
+    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_COMPRESSION, &params);
+}
+
+/* Compress file with specified parameters */
+int ulz77_compress_file_params(const char *filename_dst, const char *filename_src, const struct ulz77_params *params)
+{
+    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_COMPRESSION, params);
+}
+
+/* Decompress file */
+int ulz77_decompress_file(const char *filename_dst, const char *filename_src)
+{
+    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_DECOMPRESSION, NULL);
+}
+
+/* Decompress file compressed with dictionary */
+int ulz77_decompress_file_dict(const char *filename_dst, const char *filename_src, const struct ulz77_dict *dict)
+{
+    struct ulz77_params params;
+
+    ulz77_params_init(&params);
+    params.dict = dict;
+    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_DECOMPRESSION, &params);
+}
+
+/* Compress file through memory mapping */
+int ulz77_compress_file_mmap(const char *filename_dst, const char *filename_src, const struct ulz77_params *params)
+{
+    return ulz77_encode_file_mmap(filename_dst, filename_src, ULZ77_TYPE_COMPRESSION, params);
+}
+
+/* Decompress file through memory mapping */
+int ulz77_decompress_file_mmap(const char *filename_dst, const char *filename_src)
+{
+    return ulz77_encode_file_mmap(filename_dst, filename_src, ULZ77_TYPE_DECOMPRESSION, NULL);
+}
+
+/* Decompress file compressed with dictionary through memory mapping */
+int ulz77_decompress_file_mmap_dict(const char *filename_dst, const char *filename_src, const struct ulz77_dict *dict)
+{
+    struct ulz77_params params;
+
+    ulz77_params_init(&params);
+    params.dict = dict;
+    return ulz77_encode_file_mmap(filename_dst, filename_src, ULZ77_TYPE_DECOMPRESSION, &params);
+}
+
+enum 
+{
+    ULZ77_STREAM_WRITER_TYPE_NULL = 0,
+    ULZ77_STREAM_WRITER_TYPE_FP = 1,
+    ULZ77_STREAM_WRITER_TYPE_CB = 2,
+    ULZ77_STREAM_WRITER_TYPE_IOV = 3,
+    ULZ77_STREAM_WRITER_TYPE_FD = 4,
+};
+
+enum 
+{
+    ULZ77_STREAM_READER_TYPE_NULL = 0,
+    ULZ77_STREAM_READER_TYPE_FP = 1,
+    ULZ77_STREAM_READER_TYPE_CB = 2,
+};
+
+/* Blocks of stream, offsets are from the first block */
+struct ulz77_stream_index
+{
+    size_t count;
+    size_t capacity;
+    uint64_t *src_offsets; /* offsets of compressed blocks with sizes, count + 1 */
+    uint64_t *dst_offsets; /* offsets of decompressed data, count + 1 */
+
+    uint64_t base; /* offset of the first block in reader file */
+
+    /* the last block read */
+    unsigned char *block;
+    size_t block_id;
+    struct ulz77_decoder *dec; /* keeps the window of the last block read */
+};
+
+static struct ulz77_stream_index *stream_index_new(void)
+{
+    struct ulz77_stream_index *index;
+
+    index = (struct ulz77_stream_index *)mem_alloc(sizeof(struct ulz77_stream_index));
+    if (index == NULL) return NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->src_offsets = NULL;
+    index->dst_offsets = NULL;
+    index->base = 0;
+    index->block = NULL;
+    index->block_id = 0;
+    index->dec = NULL;
+
+    return index;
+}
+
+static void stream_index_destroy(struct ulz77_stream_index *index)
+{
+    if (index == NULL) return;
+    if (index->src_offsets != NULL) mem_free(index->src_offsets);
+    if (index->dst_offsets != NULL) mem_free(index->dst_offsets);
+    if (index->block != NULL) mem_free(index->block);
+    if (index->dec != NULL) ulz77_decoder_destroy(index->dec);
+    mem_free(index);
+}
+
+/* Append a block of src_len bytes (its size excluded), decompressed into
+ * dst_len bytes */
+static int stream_index_add(struct ulz77_stream_index *index, uint64_t src_len, uint64_t dst_len)
+{
+    size_t capacity;
+    uint64_t *new_offsets;
+
+    if (index->count + 2 > index->capacity)
+    {
+        capacity = MAX(index->capacity * 2, 64);
+        new_offsets = (uint64_t *)mem_realloc(index->src_offsets, sizeof(uint64_t) * capacity);
+        if (new_offsets == NULL) return -ULZ77_ERR_MALLOC;
+        index->src_offsets = new_offsets;
+        new_offsets = (uint64_t *)mem_realloc(index->dst_offsets, sizeof(uint64_t) * capacity);
+        if (new_offsets == NULL) return -ULZ77_ERR_MALLOC;
+        index->dst_offsets = new_offsets;
+        index->capacity = capacity;
+        if (index->count == 0) index->src_offsets[0] = index->dst_offsets[0] = 0;
+    }
+    index->src_offsets[index->count + 1] = index->src_offsets[index->count] + sizeof(uint32_t) + src_len;
+    index->dst_offsets[index->count + 1] = index->dst_offsets[index->count] + dst_len;
+    index->count++;
+
+    return 0;
+}
+
+/* Encoder, decoder and buffers of stream kept between blocks, so small
+ * blocks cost no allocation or clearing of tables */
+struct ulz77_stream_context
+{
+    struct ulz77_encoder *enc; /* created with params, reset for every block */
+    struct ulz77_params params;
+    unsigned char *dst; /* block compressed */
+    size_t dst_capacity;
+    struct ulz77_decoder *dec; /* reset for every block */
+    unsigned char *src; /* block read */
+    size_t src_capacity;
+    int src_pending; /* block read is not decoded yet, it is pulled again */
+    size_t src_len;
+    unsigned char *out; /* block decoded by ulz77_stream_pull_view() */
+    size_t out_capacity;
+
+    /* input pushed by ulz77_stream_feed() */
+    int feed_stage;
+    unsigned char *stage; /* input of block staged, [stage_begin, stage_end) not decoded */
+    size_t stage_capacity;
+    size_t stage_begin;
+    size_t stage_end;
+    size_t block_remain; /* bytes of block not staged yet */
+};
+
+enum
+{
+    FEED_SIZE = 0, /* 32 bits of block size */
+    FEED_HEADER = 1, /* header of block */
+    FEED_ENTROPY = 2, /* the whole entropy coded block */
+    FEED_BODY = 3, /* tokens or sequences */
+    FEED_SKIP = 4, /* index block */
+};
+
+/* Grow buffer to size bytes at least, keeping its data */
+static int buffer_reserve(unsigned char **buf, size_t *capacity, size_t size)
+{
+    unsigned char *new_buffer;
+
+    if (*capacity >= size) return 0;
+    new_buffer = (unsigned char *)mem_realloc(*buf, size);
+    if (new_buffer == NULL) return -ULZ77_ERR_MALLOC;
+    *buf = new_buffer;
+    *capacity = size;
+    return 0;
+}
+
+/* Get context of stream, which is created on the first use */
+static struct ulz77_stream_context *stream_context_get(struct ulz77_stream *stream)
+{
+    if (stream->context == NULL)
+        stream->context = (struct ulz77_stream_context *)mem_calloc(1, sizeof(struct ulz77_stream_context));
+    return stream->context;
+}
+
+static void stream_context_release(struct ulz77_stream_context *ctx)
+{
+    if (ctx->enc != NULL) ulz77_encoder_destroy(ctx->enc);
+    if (ctx->dec != NULL) ulz77_decoder_destroy(ctx->dec);
+    if (ctx->dst != NULL) mem_free(ctx->dst);
+    if (ctx->src != NULL) mem_free(ctx->src);
+    if (ctx->out != NULL) mem_free(ctx->out);
+    if (ctx->stage != NULL) mem_free(ctx->stage);
+}
+
+/* Compress a block into *dst grown to the bound of src_len, the encoder
+ * of context is created again only when params change */
+static int stream_context_encode(struct ulz77_stream_context *ctx, const struct ulz77_params *params, \
+        unsigned char **dst, size_t *dst_capacity, size_t *dst_len, unsigned char *src, size_t src_len)
+{
+    size_t bound = ulz77_compress_bound(src_len);
+    int ret;
+
+    if (bound == 0) return -ULZ77_ERR_INVALID_ARGS;
+    if ((ret = buffer_reserve(dst, dst_capacity, bound)) != 0) return ret;
+
+    if ((ctx->enc != NULL) && ((ctx->params.level != params->level) || \
+            (ctx->params.window_log != params->window_log) || (ctx->params.flags != params->flags) || \
+            (ctx->params.dict != params->dict)))
+    {
+        ulz77_encoder_destroy(ctx->enc);
+        ctx->enc = NULL;
+    }
+    if (ctx->enc == NULL)
+    {
+        if ((ret = params_check(params)) != 0) return ret;
+        ctx->enc = ulz77_encoder_new_params(params);
+        if (ctx->enc == NULL) return -ULZ77_ERR_MALLOC;
+        ctx->params = *params;
+    }
+    else if ((params->flags & ULZ77_FLAG_LINKED) == 0)
+    {
+        ulz77_encoder_reset(ctx->enc);
+    }
+
+    /* the bound always fits in one call */
+    ret = ulz77_encoder_encode(ctx->enc, *dst, bound, src, src_len);
+    if (ret == -ULZ77_ERR_BUFFER_FULL) ret = -ULZ77_ERR_UNKNOWN;
+    if (ret != 0)
+    {
+        ulz77_encoder_reset(ctx->enc);
+        return ret;
+    }
+    *dst_len = ctx->enc->dst_len;
+
+    return 0;
+}
+
+/* Decompress a block into dst, return -ULZ77_ERR_BUFFER_FULL with the
+ * size of block in *dst_len if it is larger than dst_cap, the decoder is
+ * left as it was then. *dec is created on the first use and keeps the
+ * window of linked blocks */
+static int stream_decode_into(const struct ulz77_dict *dict, struct ulz77_decoder **dec, \
+        unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len)
+{
+    uint64_t content_size;
+    unsigned char *buf;
+    size_t len;
+    int ret;
+
+    if ((ulz77_content_size(src, src_len, &content_size) != 0) || (content_size > (uint64_t)SIZE_MAX / 2))
+    {
+        /* output of v1 grows while it is decoded, then it is copied */
+        if ((ret = ulz77_encode_data(&buf, &len, src, src_len, ULZ77_TYPE_DECOMPRESSION, NULL)) != 0) return ret;
+        *dst_len = len;
+        if (len <= dst_cap) memcpy(dst, buf, len);
+        mem_free(buf);
+        return (len <= dst_cap) ? 0 : -ULZ77_ERR_BUFFER_FULL;
+    }
+
+    *dst_len = (size_t)content_size;
+    if ((size_t)content_size > dst_cap) return -ULZ77_ERR_BUFFER_FULL;
+    if (*dec == NULL)
+    {
+        *dec = ulz77_decoder_new();
+        if (*dec == NULL) return -ULZ77_ERR_MALLOC;
+    }
+    (*dec)->dict = dict;
+
+    /* the whole block is decoded in one call */
+    ret = ulz77_decoder_decode(*dec, dst, (size_t)content_size, src, src_len);
+    if (ret == -ULZ77_ERR_BUFFER_FULL) ret = -ULZ77_ERR_INVALID_DATA;
+    if (ret != 0)
+    {
+        ulz77_decoder_reset(*dec);
+        return ret;
+    }
+    *dst_len = (*dec)->dst_len;
+
+    return 0;
+}
+
+/* Decompress a block into memory allocated for *dst */
+static int stream_decode_block(const struct ulz77_dict *dict, struct ulz77_decoder **dec, \
+        unsigned char **dst, size_t *dst_len, unsigned char *src, size_t src_len)
+{
+    uint64_t content_size;
+    unsigned char *buf;
+    int ret;
+
+    /* output of v1 grows while it is decoded */
+    if ((ulz77_content_size(src, src_len, &content_size) != 0) || (content_size > (uint64_t)SIZE_MAX / 2))
+        return ulz77_encode_data(dst, dst_len, src, src_len, ULZ77_TYPE_DECOMPRESSION, NULL);
+
+    buf = (unsigned char *)mem_alloc(MAX((size_t)content_size, 1));
+    if (buf == NULL) return -ULZ77_ERR_MALLOC;
+    ret = stream_decode_into(dict, dec, buf, (size_t)content_size, dst_len, src, src_len);
+    if (ret != 0)
+    {
+        mem_free(buf);
+        return ret;
+    }
+    *dst = buf;
+
+    return 0;
+}
+
+/* Create a new stream */
+struct ulz77_stream *ulz77_stream_new(void)
+{
+    struct ulz77_stream *new_stream = NULL;
+    new_stream = (struct ulz77_stream *)mem_alloc(sizeof(struct ulz77_stream));
+    if (new_stream == NULL) return NULL;
+
+    ulz77_params_init(&new_stream->params);
+    new_stream->pool = NULL;
+    new_stream->context = NULL;
+    new_stream->seekable = 0;
+    new_stream->write_index = NULL;
+    new_stream->read_index = NULL;
+
+    new_stream->writer_type = ULZ77_STREAM_WRITER_TYPE_NULL;
+    new_stream->writer_fp = NULL;
+    new_stream->writer_cb = NULL;
+    new_stream->writer_iov_cb = NULL;
+    new_stream->writer_iov_opaque = NULL;
+    new_stream->writer_fd = -1;
+
+    new_stream->reader_type = ULZ77_STREAM_READER_TYPE_NULL;
+    new_stream->reader_fp = NULL;
+    new_stream->reader_cb = NULL;
+
+    return new_stream;
+}
+
+/* Destroy a stream, blocks not written yet are written first */
+int ulz77_stream_destroy(struct ulz77_stream *stream)
+{
+    int ret;
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    ret = ulz77_stream_set_threads(stream, 1);
+    stream_index_destroy(stream->write_index);
+    stream_index_destroy(stream->read_index);
+    if (stream->context != NULL)
+    {
+        stream_context_release(stream->context);
+        mem_free(stream->context);
+    }
+    mem_free(stream);
+    return ret;
+}
+
+/* Set compression level of stream */
+int ulz77_stream_set_level(struct ulz77_stream *stream, int level)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if ((level < ULZ77_LEVEL_MIN) || (level > ULZ77_LEVEL_MAX)) return -ULZ77_ERR_INVALID_ARGS;
+
+    stream->params.level = level;
+
+    return 0;
+}
+
+/* Set encoder parameters of stream */
+int ulz77_stream_set_params(struct ulz77_stream *stream, const struct ulz77_params *params)
+{
+    int ret;
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if ((ret = params_check(params)) != 0) return ret;
+
+    stream->params = *params;
+
+    return 0;
+}
+
+/* Set dictionary of stream for both pushed and pulled blocks */
+int ulz77_stream_set_dict(struct ulz77_stream *stream, const struct ulz77_dict *dict)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    stream->params.dict = dict;
+
+    return 0;
+}
+
+/* Stream writer Null */
+int ulz77_stream_set_writer_null(struct ulz77_stream *stream)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (stream->writer_fp != NULL)
+    {
+        fclose(stream->writer_fp);
+        stream->writer_fp = NULL;
+    }
+    stream->writer_cb = NULL;
+    stream->writer_iov_cb = NULL;
+    stream->writer_iov_opaque = NULL;
+    stream->writer_fd = -1;
+    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_NULL;
+    return 0;
+}
+
+/* Stream writer File Pointer */
+int ulz77_stream_set_writer_fp(struct ulz77_stream *stream, FILE *fp)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ulz77_stream_set_writer_null(stream);
+    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_FP;
+    stream->writer_fp = fp;
+
+    return 0;
+}
+
+/* Stream writer Callback */
+int ulz77_stream_set_writer_callback(struct ulz77_stream *stream, int (*writer_cb)(unsigned char *data, size_t size))
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ulz77_stream_set_writer_null(stream);
+    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_CB;
+    stream->writer_cb = writer_cb;
+
+    return 0;
+}
+
+/* Stream writer Vectored callback */
+int ulz77_stream_set_writer_iov_callback(struct ulz77_stream *stream, \
+        int (*writer_iov_cb)(void *opaque, const struct ulz77_iovec *iov, int iov_count), void *opaque)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ulz77_stream_set_writer_null(stream);
+    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_IOV;
+    stream->writer_iov_cb = writer_iov_cb;
+    stream->writer_iov_opaque = opaque;
+
+    return 0;
+}
+
+/* Stream writer File Descriptor */
+int ulz77_stream_set_writer_fd(struct ulz77_stream *stream, int fd)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+#ifdef ULZ77_POSIX
+    if (fd < 0) return -ULZ77_ERR_INVALID_WRITER;
+
+    ulz77_stream_set_writer_null(stream);
+    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_FD;
+    stream->writer_fd = fd;
+
+    return 0;
+#else
+    (void)fd;
+    return -ULZ77_ERR_INVALID_WRITER;
+#endif
+}
+
+/* Stream reader Null */
+int ulz77_stream_set_reader_null(struct ulz77_stream *stream)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (stream->reader_fp != NULL)
+    {
+        fclose(stream->reader_fp);
+        stream->reader_fp = NULL;
+    }
+    stream->reader_cb = NULL;
+    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_NULL;
+    stream_index_destroy(stream->read_index);
+    stream->read_index = NULL;
+    return 0;
+}
+
+/* Stream reader File Pointer */
+int ulz77_stream_set_reader_fp(struct ulz77_stream *stream, FILE *fp)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ulz77_stream_set_reader_null(stream);
+    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_FP;
+    stream->reader_fp = fp;
+
+    return 0;
+}
+
+/* Stream reader Callback */
+int ulz77_stream_set_reader_callback(struct ulz77_stream *stream, int (*reader_cb)(unsigned char *data, size_t size))
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ulz77_stream_set_reader_null(stream);
+    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_CB;
+    stream->reader_cb = reader_cb;
+
+    return 0;
+}
+
+#ifdef ULZ77_POSIX
+
+#define WRITEV_IOV_MAX (8) /* pieces given to writev() at once */
+
+/* Write all the pieces, writev() may take only a part of them */
+static int writev_full(int fd, const struct ulz77_iovec *iov, int iov_count)
+{
+    struct iovec vec[WRITEV_IOV_MAX], *vec_p;
+    int count, i;
+    ssize_t n;
+    size_t k;
+
+    while (iov_count > 0)
+    {
+        count = MIN(iov_count, WRITEV_IOV_MAX);
+        for (i = 0; i < count; i++)
+        {
+            vec[i].iov_base = (void *)iov[i].data;
+            vec[i].iov_len = iov[i].size;
+        }
+        iov += count;
+        iov_count -= count;
+
+        vec_p = vec;
+        for (;;)
+        {
+            /* skip the pieces written */
+            while ((count > 0) && (vec_p->iov_len == 0))
+            {
+                vec_p++;
+                count--;
+            }
+            if (count == 0) break;
+            n = writev(fd, vec_p, count);
+            if ((n < 0) && (errno == EINTR)) continue;
+            if (n <= 0) return -ULZ77_ERR_FILE_WRITE;
+            for (; n != 0; vec_p++, count--)
+            {
+                k = MIN((size_t)n, vec_p->iov_len);
+                vec_p->iov_base = (unsigned char *)vec_p->iov_base + k;
+                vec_p->iov_len -= k;
+                n -= (ssize_t)k;
+                if (vec_p->iov_len != 0) break;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif
+
+/* Write a batch of pieces with the writer of stream */
+static int stream_write_iov(struct ulz77_stream *stream, const struct ulz77_iovec *iov, int iov_count)
+{
+    int ret = 0, i;
+
+    switch (stream->writer_type)
+    {
+        case ULZ77_STREAM_WRITER_TYPE_NULL:
+            /* Do nothing */
+            break;
+        case ULZ77_STREAM_WRITER_TYPE_CB:
+            for (i = 0; (i < iov_count) && (ret == 0); i++)
+                ret = (*stream->writer_cb)((unsigned char *)iov[i].data, iov[i].size);
+            break;
+        case ULZ77_STREAM_WRITER_TYPE_FP:
+            for (i = 0; i < iov_count; i++)
+            {
+                if ((iov[i].size != 0) && (fwrite(iov[i].data, iov[i].size, 1, stream->writer_fp) < 1))
+                { ret = -ULZ77_ERR_FILE_WRITE; break; }
+            }
+            break;
+        case ULZ77_STREAM_WRITER_TYPE_IOV:
+            ret = (*stream->writer_iov_cb)(stream->writer_iov_opaque, iov, iov_count);
+            break;
+#ifdef ULZ77_POSIX
+        case ULZ77_STREAM_WRITER_TYPE_FD:
+            ret = writev_full(stream->writer_fd, iov, iov_count);
+            break;
+#endif
+        default:
+            ret = -ULZ77_ERR_UNKNOWN_WRITER;
+            break;
+    }
+
+    return ret;
+}
+
+/* Write a compressed block with its size as one batch */
+static int stream_write_block(struct ulz77_stream *stream, unsigned char *dst, size_t dst_len)
+{
+    unsigned char size_buf[sizeof(uint32_t)];
+    struct ulz77_iovec iov[2];
+    size_t i;
+
+    /* size is written in 32 bits, little endian */
+    if (dst_len > UINT32_MAX) return -ULZ77_ERR_INVALID_ARGS;
+    for (i = 0; i < sizeof(uint32_t); i++) size_buf[i] = (unsigned char)(dst_len >> (i * 8));
+
+    iov[0].data = size_buf;
+    iov[0].size = sizeof(uint32_t);
+    iov[1].data = dst;
+    iov[1].size = dst_len;
+
+    return stream_write_iov(stream, iov, 2);
+}
+
+/* Record a block written into stream */
+static int stream_record_block(struct ulz77_stream *stream, size_t dst_len, size_t src_len)
+{
+    if (stream->seekable == 0) return 0;
+    if (stream->write_index == NULL)
+    {
+        stream->write_index = stream_index_new();
+        if (stream->write_index == NULL) return -ULZ77_ERR_MALLOC;
+    }
+    return stream_index_add(stream->write_index, dst_len, src_len);
+}
+
+/* Write index block of recorded blocks */
+static int stream_write_index(struct ulz77_stream *stream)
+{
+    struct ulz77_stream_index *index = stream->write_index;
+    unsigned char *buf, *buf_p;
+    size_t count = (index != NULL) ? index->count : 0, i;
+    uint32_t index_len;
+    int ret;
+
+    buf = (unsigned char *)mem_alloc(HEADER_MAGIC_SIZE + 2 + 10 + count * 20 + INDEX_FOOTER_SIZE);
+    if (buf == NULL) return -ULZ77_ERR_MALLOC;
+
+    buf_p = buf;
+    memcpy(buf_p, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    buf_p += HEADER_MAGIC_SIZE;
+    *buf_p++ = SENTINEL;
+    *buf_p++ = INDEX_VERSION;
+    buf_p = write_varint(buf_p, count);
+    for (i = 0; i < count; i++)
+    {
+        buf_p = write_varint(buf_p, index->src_offsets[i + 1] - index->src_offsets[i] - sizeof(uint32_t));
+        buf_p = write_varint(buf_p, index->dst_offsets[i + 1] - index->dst_offsets[i]);
+    }
+    index_len = (uint32_t)(buf_p - buf + INDEX_FOOTER_SIZE);
+    for (i = 0; i < 4; i++) *buf_p++ = (unsigned char)(index_len >> (i * 8));
+    memcpy(buf_p, INDEX_MAGIC, 4);
+    buf_p += 4;
+
+    ret = stream_write_block(stream, buf, (size_t)(buf_p - buf));
+    mem_free(buf);
+
+    return ret;
+}
+
+/* Load index from the end of reader file */
+static int stream_load_index(struct ulz77_stream *stream)
+{
+    struct ulz77_stream_index *index = NULL;
+    unsigned char footer[INDEX_FOOTER_SIZE], size_buf[sizeof(uint32_t)];
+    unsigned char *buf = NULL;
+    const unsigned char *buf_p, *buf_endp;
+    uint64_t count, src_len, dst_len, i;
+    uint32_t index_len;
+    int64_t file_len;
+    int ret;
+
+    if (stream->reader_type != ULZ77_STREAM_READER_TYPE_FP) return -ULZ77_ERR_INVALID_READER;
+
+    /* footer, then the block of index */
+    if ((ulz77_fseek(stream->reader_fp, 0, SEEK_END) != 0) || \
+            ((file_len = (int64_t)ulz77_ftell(stream->reader_fp)) < INDEX_FOOTER_SIZE + 4) || \
+            (ulz77_fseek(stream->reader_fp, file_len - INDEX_FOOTER_SIZE, SEEK_SET) != 0) || \
+            (fread(footer, INDEX_FOOTER_SIZE, 1, stream->reader_fp) < 1))
+    {
+        return -ULZ77_ERR_FILE_READ;
+    }
+    index_len = read_le32(footer);
+    if ((memcmp(footer + 4, INDEX_MAGIC, 4) != 0) || (index_len < HEADER_MAGIC_SIZE + 3 + INDEX_FOOTER_SIZE) || \
+            ((int64_t)index_len + 4 > file_len))
+    {
+        return -ULZ77_ERR_INVALID_DATA;
+    }
+    buf = (unsigned char *)mem_alloc(index_len);
+    if (buf == NULL) return -ULZ77_ERR_MALLOC;
+    if ((ulz77_fseek(stream->reader_fp, file_len - index_len - 4, SEEK_SET) != 0) || \
+            (fread(size_buf, sizeof(uint32_t), 1, stream->reader_fp) < 1) || \
+            (fread(buf, index_len, 1, stream->reader_fp) < 1))
+    {
+        ret = -ULZ77_ERR_FILE_READ;
+        goto fail;
+    }
+    if ((read_le32(size_buf) != index_len) || (is_index_block(buf, index_len) == 0))
+    {
+        ret = -ULZ77_ERR_INVALID_DATA;
+        goto fail;
+    }
+
+    index = stream_index_new();
+    if (index == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto fail;
+    }
+    buf_p = buf + HEADER_MAGIC_SIZE + 2;
+    buf_endp = buf + index_len - INDEX_FOOTER_SIZE;
+    if ((buf_p = read_varint(buf_p, buf_endp, 10, &count)) == NULL) { ret = -ULZ77_ERR_INVALID_DATA; goto fail; }
+    for (i = 0; i < count; i++)
+    {
+        if (((buf_p = read_varint(buf_p, buf_endp, 10, &src_len)) == NULL) || \
+                ((buf_p = read_varint(buf_p, buf_endp, 10, &dst_len)) == NULL) || \
+                (src_len > UINT32_MAX) || (dst_len > (uint64_t)SIZE_MAX / 2))
+        {
+            ret = -ULZ77_ERR_INVALID_DATA;
+            goto fail;
+        }
+        if ((ret = stream_index_add(index, src_len, dst_len)) != 0) goto fail;
+    }
+    /* blocks are right before the index */
+    if ((buf_p != buf_endp) || ((count != 0) && (index->src_offsets[count] > (uint64_t)(file_len - index_len - 4))))
+    {
+        ret = -ULZ77_ERR_INVALID_DATA;
+        goto fail;
+    }
+    index->base = (uint64_t)(file_len - index_len - 4) - ((count != 0) ? index->src_offsets[count] : 0);
+
+    mem_free(buf);
+    stream->read_index = index;
+    return 0;
+fail:
+    if (buf != NULL) mem_free(buf);
+    stream_index_destroy(index);
+    return ret;
+}
+
+/* Read compressed block of index from reader into the buffer of context */
+static int stream_load_block(struct ulz77_stream *stream, struct ulz77_stream_context *ctx, size_t block_id, size_t *src_len)
+{
+    struct ulz77_stream_index *index = stream->read_index;
+    int ret;
+
+    *src_len = (size_t)(index->src_offsets[block_id + 1] - index->src_offsets[block_id] - sizeof(uint32_t));
+    if ((ret = buffer_reserve(&ctx->src, &ctx->src_capacity, MAX(*src_len, 1))) != 0) return ret;
+    if ((ulz77_fseek(stream->reader_fp, (int64_t)(index->base + index->src_offsets[block_id] + sizeof(uint32_t)), SEEK_SET) != 0) || \
+            (fread(ctx->src, *src_len, 1, stream->reader_fp) < 1))
+        return -ULZ77_ERR_FILE_READ;
+    return 0;
+}
+
+/* Decode block of index from reader, a linked block needs the window of
+ * the previous one, so blocks are decoded from the beginning of the chain
+ * unless the previous block is the last one read */
+static int stream_read_block(struct ulz77_stream *stream, size_t block_id)
+{
+    struct ulz77_stream_index *index = stream->read_index;
+    struct ulz77_stream_context *ctx;
+    struct ulz77_header header;
+    unsigned char *dst;
+    size_t src_len, dst_len, first = block_id;
+    int ret;
+
+    if ((index->block != NULL) && (index->block_id == block_id)) return 0;
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+
+    if ((index->block == NULL) || (index->block_id + 1 != block_id))
+    {
+        while (first != 0)
+        {
+            if ((ret = stream_load_block(stream, ctx, first, &src_len)) != 0) goto fail;
+            if ((parse_header(ctx->src, src_len, &header) != 0) || (header.format != ULZ77_FORMAT_V2) || \
+                    ((header.flags & ULZ77_FLAG_LINKED) == 0))
+                break;
+            first--;
+        }
+    }
+
+    for (; first <= block_id; first++)
+    {
+        if ((ret = stream_load_block(stream, ctx, first, &src_len)) != 0) goto fail;
+        if ((ret = stream_decode_block(stream->params.dict, &index->dec, &dst, &dst_len, ctx->src, src_len)) != 0) goto fail;
+        if (index->block != NULL) mem_free(index->block);
+        index->block = dst;
+        index->block_id = first;
+        if ((uint64_t)dst_len != index->dst_offsets[first + 1] - index->dst_offsets[first])
+        {
+            ret = -ULZ77_ERR_INVALID_DATA;
+            goto fail;
+        }
+    }
+
+    return 0;
+fail:
+    /* the window of decoder no longer follows the block kept */
+    if (index->block != NULL) mem_free(index->block);
+    index->block = NULL;
+    return ret;
+}
+
+#ifdef ULZ77_THREADS
+
+/* A block pushed into stream */
+struct stream_job
+{
+    unsigned char *src;
+    size_t src_len;
+    size_t src_capacity;
+    struct ulz77_params params;
+    unsigned char *dst;
+    size_t dst_len;
+    size_t dst_capacity;
+    int done;
+    int ret;
+};
+
+struct ulz77_stream_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t job_pushed; /* a job to take, or quit */
+    pthread_cond_t job_done;
+    pthread_t *workers;
+    int worker_count;
+    int quit;
+
+    /* ring of jobs, counters only grow */
+    struct stream_job *jobs;
+    size_t job_count;
+    uint64_t head; /* the oldest job, written next */
+    uint64_t next; /* the next job for workers */
+    uint64_t tail; /* the next slot to push */
+};
+
+static void *stream_pool_worker(void *arg)
+{
+    struct ulz77_stream_pool *pool = (struct ulz77_stream_pool *)arg;
+    struct ulz77_stream_context ctx; /* the encoder of worker, blocks go into buffers of jobs */
+    struct stream_job *job;
+
+    memset(&ctx, 0, sizeof(struct ulz77_stream_context));
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while ((pool->next == pool->tail) && (pool->quit == 0))
+            pthread_cond_wait(&pool->job_pushed, &pool->lock);
+        if (pool->next == pool->tail) break;
+        job = &pool->jobs[pool->next++ % pool->job_count];
+        pthread_mutex_unlock(&pool->lock);
+
+        job->ret = stream_context_encode(&ctx, &job->params, &job->dst, &job->dst_capacity, &job->dst_len, job->src, job->src_len);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    stream_context_release(&ctx);
+
+    return NULL;
+}
+
+static void stream_pool_destroy(struct ulz77_stream_pool *pool)
+{
+    size_t i;
+    int j;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->job_pushed);
+    pthread_mutex_unlock(&pool->lock);
+    for (j = 0; j < pool->worker_count; j++) pthread_join(pool->workers[j], NULL);
+
+    pthread_cond_destroy(&pool->job_pushed);
+    pthread_cond_destroy(&pool->job_done);
+    pthread_mutex_destroy(&pool->lock);
+    for (i = 0; i < pool->job_count; i++)
+    {
+        if (pool->jobs[i].src != NULL) mem_free(pool->jobs[i].src);
+        if (pool->jobs[i].dst != NULL) mem_free(pool->jobs[i].dst);
+    }
+    mem_free(pool->jobs);
+    mem_free(pool->workers);
+    mem_free(pool);
+}
+
+static struct ulz77_stream_pool *stream_pool_new(int threads)
+{
+    struct ulz77_stream_pool *pool;
+
+    pool = (struct ulz77_stream_pool *)mem_alloc(sizeof(struct ulz77_stream_pool));
+    if (pool == NULL) return NULL;
+    pool->worker_count = 0;
+    pool->quit = 0;
+    /* workers keep busy while the oldest block is being written */
+    pool->job_count = (size_t)threads * 2;
+    pool->head = pool->next = pool->tail = 0;
+    pool->workers = (pthread_t *)mem_alloc(sizeof(pthread_t) * (size_t)threads);
+    pool->jobs = (struct stream_job *)mem_calloc(pool->job_count, sizeof(struct stream_job));
+    if ((pool->workers == NULL) || (pool->jobs == NULL))
+    {
+        if (pool->workers != NULL) mem_free(pool->workers);
+        if (pool->jobs != NULL) mem_free(pool->jobs);
+        mem_free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_pushed, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    while (pool->worker_count < threads)
+    {
+        if (pthread_create(&pool->workers[pool->worker_count], NULL, stream_pool_worker, pool) != 0)
+        {
+            stream_pool_destroy(pool);
+            return NULL;
+        }
+        pool->worker_count++;
+    }
+
+    return pool;
+}
+
+/* Write the oldest block of pool, wait for it if wait is set, return
+ * -ULZ77_ERR_BUFFER_FULL if it is not done yet */
+static int stream_pool_retire(struct ulz77_stream *stream, int wait)
+{
+    struct ulz77_stream_pool *pool = stream->pool;
+    struct stream_job *job = &pool->jobs[pool->head % pool->job_count];
+    int ret, done;
+
+    pthread_mutex_lock(&pool->lock);
+    while ((job->done == 0) && (wait != 0))
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    done = job->done;
+    pthread_mutex_unlock(&pool->lock);
+    if (done == 0) return -ULZ77_ERR_BUFFER_FULL;
+
+    /* only the pushing thread touches a job which is done */
+    ret = job->ret;
+    if (ret == 0) ret = stream_write_block(stream, job->dst, job->dst_len);
+    if (ret == 0) ret = stream_record_block(stream, job->dst_len, job->src_len);
+    job->done = 0;
+    pool->head++;
+
+    return ret;
+}
+
+/* Push data into pool of stream */
+static int stream_pool_push(struct ulz77_stream *stream, unsigned char *data, size_t size)
+{
+    struct ulz77_stream_pool *pool = stream->pool;
+    struct stream_job *job;
+    unsigned char *new_src;
+    int ret;
+
+    /* write the blocks done, wait for the oldest when every slot is taken */
+    while (pool->head != pool->tail)
+    {
+        ret = stream_pool_retire(stream, (pool->tail - pool->head == pool->job_count) ? 1 : 0);
+        if (ret == -ULZ77_ERR_BUFFER_FULL) break;
+        if (ret != 0) return ret;
+    }
+
+    job = &pool->jobs[pool->tail % pool->job_count];
+    if (job->src_capacity < size)
+    {
+        new_src = (unsigned char *)mem_realloc(job->src, size);
+        if (new_src == NULL) return -ULZ77_ERR_MALLOC;
+        job->src = new_src;
+        job->src_capacity = size;
+    }
+    if (size != 0) memcpy(job->src, data, size);
+    job->src_len = size;
+    job->params = stream->params;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->tail++;
+    pthread_cond_signal(&pool->job_pushed);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+#endif
+
+
+/* Push data into stream */
+int ulz77_stream_push(struct ulz77_stream *stream, unsigned char *data, size_t size)
+{
+    int ret = 0;
+    struct ulz77_stream_context *ctx;
+    size_t dst_len = 0;
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+#ifdef ULZ77_THREADS
+    if (stream->pool != NULL)
+    {
+        if ((stream->params.flags & ULZ77_FLAG_LINKED) == 0) return stream_pool_push(stream, data, size);
+        /* linked blocks go through one encoder in order */
+        if ((ret = ulz77_stream_flush(stream)) != 0) return ret;
+    }
+#endif
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+
+    /* Compress data */
+    ret = stream_context_encode(ctx, &stream->params, &ctx->dst, &ctx->dst_capacity, &dst_len, data, size);
+    if (ret != 0) return ret;
+
+    ret = stream_write_block(stream, ctx->dst, dst_len);
+    if (ret == 0) ret = stream_record_block(stream, dst_len, size);
+
+    return ret;
+}
+
+/* Set number of threads compressing pushed blocks */
+int ulz77_stream_set_threads(struct ulz77_stream *stream, int threads)
+{
+    int ret;
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if (threads < 1) return -ULZ77_ERR_INVALID_ARGS;
+
+    ret = ulz77_stream_flush(stream);
+#ifdef ULZ77_THREADS
+    if (stream->pool != NULL)
+    {
+        stream_pool_destroy(stream->pool);
+        stream->pool = NULL;
+    }
+    if ((ret == 0) && (threads > 1))
+    {
+        stream->pool = stream_pool_new(threads);
+        if (stream->pool == NULL) ret = -ULZ77_ERR_THREAD;
+    }
+#else
+    if ((ret == 0) && (threads > 1)) ret = -ULZ77_ERR_THREAD;
+#endif
+
+    return ret;
+}
+
+/* Write all the blocks pushed into stream */
+int ulz77_stream_flush(struct ulz77_stream *stream)
+{
+    int ret = 0;
+#ifdef ULZ77_THREADS
+    int ret_retire;
+#endif
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+#ifdef ULZ77_THREADS
+    /* retire every block even after an error, only the first is kept */
+    while ((stream->pool != NULL) && (stream->pool->head != stream->pool->tail))
+    {
+        ret_retire = stream_pool_retire(stream, 1);
+        if (ret == 0) ret = ret_retire;
+    }
+#endif
+
+    return ret;
+}
+
+/* Record blocks written into the index, which is written at the end */
+int ulz77_stream_set_seekable(struct ulz77_stream *stream, int seekable)
+{
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    stream->seekable = seekable;
+
+    return 0;
+}
+
+/* End stream, write all the blocks and the index of a seekable stream */
+int ulz77_stream_end(struct ulz77_stream *stream)
+{
+    int ret;
+
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+
+    ret = ulz77_stream_flush(stream);
+    if ((ret == 0) && (stream->seekable != 0)) ret = stream_write_index(stream);
+    /* blocks pushed later belong to another index, and never link to these */
+    stream_index_destroy(stream->write_index);
+    stream->write_index = NULL;
+    if ((stream->context != NULL) && (stream->context->enc != NULL)) ulz77_encoder_reset(stream->context->enc);
+
+    return ret;
+}
+
+/* Stage pushed input of the block, up to want bytes in stage */
+static int stream_feed_stage(struct ulz77_stream_context *ctx, const unsigned char **src_pp, const unsigned char *src_endp, size_t want)
+{
+    size_t n;
+    int ret;
+
+    if (want > ctx->stage_capacity)
+    {
+        if ((ret = buffer_reserve(&ctx->stage, &ctx->stage_capacity, want)) != 0) return ret;
+    }
+    if ((ctx->stage_begin != 0) && (want > ctx->stage_capacity - ctx->stage_begin))
+    {
+        memmove(ctx->stage, ctx->stage + ctx->stage_begin, ctx->stage_end - ctx->stage_begin);
+        ctx->stage_end -= ctx->stage_begin;
+        ctx->stage_begin = 0;
+    }
+    n = MIN(MIN(want - (ctx->stage_end - ctx->stage_begin), (size_t)(src_endp - *src_pp)), ctx->block_remain);
+    memcpy(ctx->stage + ctx->stage_end, *src_pp, n);
+    ctx->stage_end += n;
+    *src_pp += n;
+    ctx->block_remain -= n;
+    return 0;
+}
+
+/* Start decoding the block staged, which begins with the header */
+static int stream_feed_begin(struct ulz77_stream *stream, struct ulz77_stream_context *ctx)
+{
+    struct ulz77_decoder *dec = ctx->dec;
+    int ret;
+
+    if (is_index_block(ctx->stage, ctx->stage_end))
+    {
+        ctx->stage_begin = ctx->stage_end = 0;
+        ctx->feed_stage = FEED_SKIP;
+        return 0;
+    }
+    dec->dict = stream->params.dict;
+    if ((ret = decoder_begin(dec, ctx->stage, ctx->stage_end)) < 0) return ret;
+    ctx->stage_begin = (size_t)ret;
+    /* blocks of v1 are independent in stream */
+    if (dec->format == ULZ77_FORMAT_V1) dec->window_len = 0;
+    if ((ret = decoder_reserve_window(dec)) != 0) return ret;
+    if (dec->window_capacity < dec->window_size * 2) return -ULZ77_ERR_NARROW_BUFFER_SIZE;
+    ctx->feed_stage = ((dec->flags & ULZ77_FLAG_ENTROPY) != 0) ? FEED_ENTROPY : FEED_BODY;
+    return 0;
+}
+
+/* Decode stream from pushed input in pieces of any size */
+int ulz77_stream_feed(struct ulz77_stream *stream, unsigned char *dst, size_t dst_cap, size_t *dst_len, \
+        const unsigned char *src, size_t src_len, size_t *src_used)
+{
+    int ret = 0, last;
+    struct ulz77_stream_context *ctx;
+    struct ulz77_decoder *dec;
+    const unsigned char *src_p = src, *src_endp = src + src_len, *in_p, *in_begin, *in_endp;
+    unsigned char *dst_p = dst, *dst_endp = dst + dst_cap, *out, *out_p;
+    size_t budget, out_len, keep;
+    uint32_t block_size;
+
+    if ((stream == NULL) || (dst_len == NULL) || (src_used == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if (((dst == NULL) && (dst_cap != 0)) || ((src == NULL) && (src_len != 0))) return -ULZ77_ERR_NULL_PTR;
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+    if ((ctx->dec == NULL) && ((ctx->dec = ulz77_decoder_new()) == NULL)) return -ULZ77_ERR_MALLOC;
+    dec = ctx->dec;
+
+    for (;;)
+    {
+        if (ctx->feed_stage == FEED_SIZE)
+        {
+            ctx->block_remain = sizeof(uint32_t) - ctx->stage_end;
+            if ((ret = stream_feed_stage(ctx, &src_p, src_endp, sizeof(uint32_t))) != 0) goto done;
+            if (ctx->stage_end < sizeof(uint32_t)) break;
+            block_size = read_le32(ctx->stage);
+            if (block_size == 0)
+            {
+                ret = -ULZ77_ERR_INVALID_DATA;
+                goto done;
+            }
+            ctx->stage_begin = ctx->stage_end = 0;
+            ctx->block_remain = block_size;
+            ctx->feed_stage = FEED_HEADER;
+        }
+        if (ctx->feed_stage == FEED_HEADER)
+        {
+            /* the header is complete, or the block is shorter */
+            if ((ret = stream_feed_stage(ctx, &src_p, src_endp, ULZ77_HEADER_SIZE_MAX)) != 0) goto done;
+            if ((ctx->stage_end < ULZ77_HEADER_SIZE_MAX) && (ctx->block_remain != 0)) break;
+            if ((ret = stream_feed_begin(stream, ctx)) != 0) goto done;
+        }
+        if (ctx->feed_stage == FEED_SKIP)
+        {
+            budget = MIN(ctx->block_remain, (size_t)(src_endp - src_p));
+            src_p += budget;
+            ctx->block_remain -= budget;
+            if (ctx->block_remain != 0) break;
+            ctx->feed_stage = FEED_SIZE;
+            continue;
+        }
+        if (ctx->feed_stage == FEED_ENTROPY)
+        {
+            /* streams are coded as a whole */
+            if ((ret = stream_feed_stage(ctx, &src_p, src_endp, ctx->stage_end - ctx->stage_begin + ctx->block_remain)) != 0) goto done;
+            if (ctx->block_remain != 0) break;
+            if ((ret = decoder_entropy_begin(dec, ctx->stage + ctx->stage_begin, ctx->stage + ctx->stage_end)) != 0) goto done;
+            ctx->stage_begin = ctx->stage_end;
+            ctx->feed_stage = FEED_BODY;
+        }
+
+        /* body */
+        if ((dec->flags & ULZ77_FLAG_ENTROPY) != 0)
+        {
+            in_p = dec->entropy_p;
+            in_endp = dec->entropy_endp;
+            last = 1;
+        }
+        else
+        {
+            if ((ctx->stage_end - ctx->stage_begin < FEED_TOKEN_MAX) && (ctx->block_remain != 0) && (src_p != src_endp))
+            {
+                if ((ret = stream_feed_stage(ctx, &src_p, src_endp, FEED_STAGE_SIZE)) != 0) goto done;
+            }
+            in_p = ctx->stage + ctx->stage_begin;
+            in_endp = ctx->stage + ctx->stage_end;
+            last = (ctx->block_remain == 0);
+        }
+
+        /* output goes through the window, which slides when it is full */
+        if ((dec->window_len > dec->window_size) && (dec->window_capacity - dec->window_len < (size_t)(dst_endp - dst_p)))
+        {
+            keep = MIN(dec->window_len, dec->window_size);
+            memmove(dec->window, dec->window + dec->window_len - keep, keep);
+            dec->window_len = (unsigned int)keep;
+        }
+        budget = MIN((size_t)(dst_endp - dst_p), (size_t)(dec->window_capacity - dec->window_len));
+        if ((dec->format == ULZ77_FORMAT_V2) && (dec->content_size - dec->block_len < budget))
+            budget = (size_t)(dec->content_size - dec->block_len);
+
+        in_begin = in_p;
+        out = dec->window + dec->window_len;
+        out_p = out;
+        ret = decoder_decode_body(dec, out, dec->window_capacity - dec->window_len, &out_p, out + budget, &in_p, in_endp, last);
+        /* a full budget is judged by the progress below */
+        if (ret == -ULZ77_ERR_BUFFER_FULL) ret = 0;
+        out_len = (size_t)(out_p - out);
+        memcpy(dst_p, out, out_len);
+        dst_p += out_len;
+        dec->window_len += (unsigned int)out_len;
+        dec->block_len += out_len;
+        if ((dec->flags & ULZ77_FLAG_ENTROPY) != 0)
+            dec->entropy_p = (unsigned char *)in_p;
+        else
+            ctx->stage_begin = (size_t)(in_p - ctx->stage);
+        if (ret != 0) goto done;
+
+        if (last && (in_p == in_endp) && (dec->match_remain == 0) && (dec->sequence_stage == 0))
+        {
+            /* the block must end exactly at the content size */
+            if ((dec->format == ULZ77_FORMAT_V2) && (dec->block_len != dec->content_size))
+            {
+                ret = -ULZ77_ERR_INVALID_DATA;
+                goto done;
+            }
+            ctx->stage_begin = ctx->stage_end = 0;
+            ctx->feed_stage = FEED_SIZE;
+            continue;
+        }
+        if ((out_len != 0) || (in_p != in_begin)) continue;
+        if (dst_p == dst_endp)
+        {
+            ret = -ULZ77_ERR_BUFFER_FULL;
             goto done;
         }
-        fwrite(dst, dst_len, 1, fp_dst);
+        /* stuck for more input, or the output of v2 is over the content size */
+        if (last || (budget == 0)) ret = -ULZ77_ERR_INVALID_DATA;
+        if ((ret != 0) || (src_p == src_endp)) goto done;
     }
 
 done:
-    if (src != NULL) free(src);
-    if (dst != NULL) free(dst);
-    if (fp_src != NULL) fclose(fp_src);
-    if (fp_dst != NULL) fclose(fp_dst);
-
+    if ((ret != 0) && (ret != -ULZ77_ERR_BUFFER_FULL)) ulz77_stream_feed_end(stream);
+    *dst_len = (size_t)(dst_p - dst);
+    *src_used = (size_t)(src_p - src);
     return ret;
 }
 
-/* Compress file */
-int ulz77_compress_file(const char *filename_dst, const char *filename_src)
+/* End input pushed, the next one starts a stream */
+int ulz77_stream_feed_end(struct ulz77_stream *stream)
 {
-    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_COMPRESSION);
-}
+    struct ulz77_stream_context *ctx;
+    int ret = 0;
 
-/* Decompress file */
-int ulz77_decompress_file(const char *filename_dst, const char *filename_src)
-{
-    return ulz77_encode_file(filename_dst, filename_src, ULZ77_TYPE_DECOMPRESSION);
+    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if ((ctx = stream->context) == NULL) return 0;
+    /* stream ends between blocks */
+    if ((ctx->feed_stage != FEED_SIZE) || (ctx->stage_end != 0)) ret = -ULZ77_ERR_INVALID_DATA;
+    ctx->feed_stage = FEED_SIZE;
+    ctx->stage_begin = ctx->stage_end = 0;
+    ctx->block_remain = 0;
+    if (ctx->dec != NULL) ulz77_decoder_reset(ctx->dec);
+    return ret;
 }
 
-enum 
+/* Read the next block from reader into the buffer of context, unless the
+ * block read before is not decoded yet */
+static int stream_pull_load(struct ulz77_stream *stream, struct ulz77_stream_context *ctx)
 {
-    ULZ77_STREAM_WRITER_TYPE_NULL = 0,
-    ULZ77_STREAM_WRITER_TYPE_FP = 1,
-    ULZ77_STREAM_WRITER_TYPE_CB = 2,
-};
+    unsigned char size_buf[sizeof(uint32_t)];
+    uint32_t block_size;
+    int ret;
 
-enum 
-{
-    ULZ77_STREAM_READER_TYPE_NULL = 0,
-    ULZ77_STREAM_READER_TYPE_FP = 1,
-    ULZ77_STREAM_READER_TYPE_CB = 2,
-};
+    if (ctx->src_pending != 0) return 0;
+    switch (stream->reader_type)
+    {
+        case ULZ77_STREAM_READER_TYPE_NULL:
+            return -ULZ77_ERR_INVALID_READER;
+        case ULZ77_STREAM_READER_TYPE_FP:
+            /* Read block size */
+            if (fread(size_buf, sizeof(uint32_t), 1, stream->reader_fp) < 1)
+                return -ULZ77_ERR_FILE_READ;
+            block_size = read_le32(size_buf);
+            /* Grow space for block */
+            if ((ret = buffer_reserve(&ctx->src, &ctx->src_capacity, MAX(block_size, 1))) != 0) return ret;
+            /* Read block */
+            if (fread(ctx->src, block_size, 1, stream->reader_fp) < 1)
+                return -ULZ77_ERR_FILE_READ;
+            break;
+        case ULZ77_STREAM_READER_TYPE_CB:
+            /* Read block size */
+            if ((*stream->reader_cb)(size_buf, sizeof(uint32_t)) != 0)
+                return -ULZ77_ERR_FILE_READ;
+            block_size = read_le32(size_buf);
+            /* Grow space for block */
+            if ((ret = buffer_reserve(&ctx->src, &ctx->src_capacity, MAX(block_size, 1))) != 0) return ret;
+            /* Read block */
+            if ((block_size != 0) && ((*stream->reader_cb)(ctx->src, block_size) != 0))
+                return -ULZ77_ERR_FILE_READ;
+            break;
+        default:
+            return -ULZ77_ERR_UNKNOWN_READER;
+    }
 
-/* Create a new stream */
-struct ulz77_stream *ulz77_stream_new(void)
-{
-    struct ulz77_stream *new_stream = NULL;
-    new_stream = (struct ulz77_stream *)malloc(sizeof(struct ulz77_stream));
-    if (new_stream == NULL) return NULL;
+    ctx->src_len = block_size;
+    ctx->src_pending = 1;
+    stream->reader_count = block_size + 4; /* 4 is the size of block size */
+    stream->reader_total_count += block_size;
+    return 0;
+}
 
-    new_stream->writer_type = ULZ77_STREAM_WRITER_TYPE_NULL;
-    new_stream->writer_fp = NULL;
-    new_stream->writer_cb = NULL;
+/* Pull data from stream */
+int ulz77_stream_pull(struct ulz77_stream *stream, unsigned char **data, size_t *size)
+{
+    int ret;
+    struct ulz77_stream_context *ctx;
+    unsigned char *dst = NULL;
+    size_t dst_len = 0;
 
-    new_stream->reader_type = ULZ77_STREAM_READER_TYPE_NULL;
-    new_stream->reader_fp = NULL;
-    new_stream->reader_cb = NULL;
+    if ((stream == NULL) || (data == NULL) || (size == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+    if ((ret = stream_pull_load(stream, ctx)) != 0) return ret;
 
-    return new_stream;
+    /* index of seekable stream gives no data */
+    if (!is_index_block(ctx->src, ctx->src_len))
+        ret = stream_decode_block(stream->params.dict, &ctx->dec, &dst, &dst_len, ctx->src, ctx->src_len);
+    ctx->src_pending = 0;
+    if (ret != 0) return ret;
+    *data = dst;
+    *size = dst_len;
+    return 0;
 }
 
-/* Destroy a stream */
-int ulz77_stream_destroy(struct ulz77_stream *stream)
+/* Pull data from stream into dst of caller */
+int ulz77_stream_pull_into(struct ulz77_stream *stream, unsigned char *dst, size_t dst_cap, size_t *size)
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
-    free(stream);
-    return 0;
+    int ret;
+    struct ulz77_stream_context *ctx;
+    size_t dst_len = 0;
+
+    if ((stream == NULL) || (dst == NULL) || (size == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+    if ((ret = stream_pull_load(stream, ctx)) != 0) return ret;
+
+    if (!is_index_block(ctx->src, ctx->src_len))
+        ret = stream_decode_into(stream->params.dict, &ctx->dec, dst, dst_cap, &dst_len, ctx->src, ctx->src_len);
+    /* a block larger than dst stays for the next pull */
+    if (ret != -ULZ77_ERR_BUFFER_FULL) ctx->src_pending = 0;
+    if ((ret != 0) && (ret != -ULZ77_ERR_BUFFER_FULL)) return ret;
+    *size = dst_len;
+    return ret;
 }
 
-/* Stream writer Null */
-int ulz77_stream_set_writer_null(struct ulz77_stream *stream)
+/* Pull data from stream into the buffer of stream */
+int ulz77_stream_pull_view(struct ulz77_stream *stream, const unsigned char **data, size_t *size)
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
-    if (stream->writer_fp != NULL)
+    int ret;
+    struct ulz77_stream_context *ctx;
+
+    if ((stream == NULL) || (data == NULL) || (size == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if ((ctx = stream_context_get(stream)) == NULL) return -ULZ77_ERR_MALLOC;
+    if ((ret = buffer_reserve(&ctx->out, &ctx->out_capacity, 1)) != 0) return ret;
+
+    /* the buffer grows to the first block larger than it, and is kept */
+    ret = ulz77_stream_pull_into(stream, ctx->out, ctx->out_capacity, size);
+    if (ret == -ULZ77_ERR_BUFFER_FULL)
     {
-        fclose(stream->writer_fp);
-        stream->writer_fp = NULL;
+        if ((ret = buffer_reserve(&ctx->out, &ctx->out_capacity, *size)) != 0) return ret;
+        ret = ulz77_stream_pull_into(stream, ctx->out, ctx->out_capacity, size);
     }
-    stream->writer_cb = NULL;
-    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_NULL;
+    if (ret != 0) return ret;
+    *data = ctx->out;
     return 0;
 }
 
-/* Stream writer File Pointer */
-int ulz77_stream_set_writer_fp(struct ulz77_stream *stream, FILE *fp)
-{
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
-
-    ulz77_stream_set_writer_null(stream);
-    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_FP;
-    stream->writer_fp = fp;
+#ifdef ULZ77_THREADS
 
-    return 0;
-}
+/* A block of stream file */
+struct stream_file_block
+{
+    off_t src_offset;
+    size_t src_len;
+    off_t dst_offset;
+    uint64_t dst_len; /* unknown (v1) blocks are decoded in order */
+};
 
-/* Stream writer Callback */
-int ulz77_stream_set_writer_callback(struct ulz77_stream *stream, int (*writer_cb)(unsigned char *data, size_t size))
+struct stream_file_job
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    pthread_mutex_t lock;
+    int fd_src;
+    int fd_dst;
+    const struct ulz77_dict *dict;
+    unsigned char *dst; /* destination mapped, unless sizes are unknown */
+    size_t dst_len;
+    struct stream_file_block *blocks;
+    size_t block_count;
+    size_t next; /* the next block for workers */
+    int ordered; /* sizes are unknown or blocks are linked, one worker decodes blocks in order */
+    int unsized; /* sizes of v1 blocks are known after decoding */
+    int ret; /* the first error */
+};
 
-    ulz77_stream_set_writer_null(stream);
-    stream->writer_type = ULZ77_STREAM_WRITER_TYPE_CB;
-    stream->writer_cb = writer_cb;
+static int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+    unsigned char *buf_p = (unsigned char *)buf;
+    ssize_t n;
 
+    while (len != 0)
+    {
+        n = pread(fd, buf_p, len, offset);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -ULZ77_ERR_FILE_READ;
+        buf_p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
     return 0;
 }
 
-/* Stream reader Null */
-int ulz77_stream_set_reader_null(struct ulz77_stream *stream)
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
-    if (stream->reader_fp != NULL)
+    const unsigned char *buf_p = (const unsigned char *)buf;
+    ssize_t n;
+
+    while (len != 0)
     {
-        fclose(stream->reader_fp);
-        stream->reader_fp = NULL;
+        n = pwrite(fd, buf_p, len, offset);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -ULZ77_ERR_FILE_WRITE;
+        buf_p += n;
+        len -= (size_t)n;
+        offset += n;
     }
-    stream->reader_cb = NULL;
-    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_NULL;
     return 0;
 }
 
-/* Stream reader File Pointer */
-int ulz77_stream_set_reader_fp(struct ulz77_stream *stream, FILE *fp)
+static void *stream_file_worker(void *arg)
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    struct stream_file_job *job = (struct stream_file_job *)arg;
+    struct stream_file_block *block;
+    struct ulz77_decoder *dec = NULL; /* keeps the window of linked blocks */
+    unsigned char *src = NULL, *new_src, *dst;
+    size_t src_capacity = 0, dst_len;
+    off_t dst_offset = 0;
+    int ret;
 
-    ulz77_stream_set_reader_null(stream);
-    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_FP;
-    stream->reader_fp = fp;
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        if ((job->ret != 0) || (job->next == job->block_count))
+        {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        block = &job->blocks[job->next++];
+        pthread_mutex_unlock(&job->lock);
 
-    return 0;
+        if (src_capacity < block->src_len)
+        {
+            new_src = (unsigned char *)mem_realloc(src, block->src_len);
+            if (new_src == NULL) { ret = -ULZ77_ERR_MALLOC; goto fail; }
+            src = new_src;
+            src_capacity = block->src_len;
+        }
+        if ((ret = pread_full(job->fd_src, src, block->src_len, block->src_offset)) != 0) goto fail;
+
+        if (job->dst != NULL)
+        {
+            /* decoded at its offset of the mapped destination */
+            ret = stream_decode_into(job->dict, &dec, job->dst + block->dst_offset, (size_t)block->dst_len, \
+                    &dst_len, src, block->src_len);
+            if ((ret == 0) && ((uint64_t)dst_len != block->dst_len)) ret = -ULZ77_ERR_INVALID_DATA;
+            if (ret != 0) goto fail;
+            continue;
+        }
+
+        /* v1 blocks are written in order after decoding */
+        dst = NULL;
+        ret = stream_decode_block(job->dict, &dec, &dst, &dst_len, src, block->src_len);
+        if (ret != 0) goto fail;
+        ret = pwrite_full(job->fd_dst, dst, dst_len, dst_offset);
+        dst_offset += (off_t)dst_len;
+        mem_free(dst);
+        if (ret != 0) goto fail;
+    }
+    ret = 0;
+fail:
+    if (ret != 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        if (job->ret == 0) job->ret = ret;
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (src != NULL) mem_free(src);
+    if (dec != NULL) ulz77_decoder_destroy(dec);
+    return NULL;
 }
 
-/* Stream reader Callback */
-int ulz77_stream_set_reader_callback(struct ulz77_stream *stream, int (*reader_cb)(unsigned char *data, size_t size))
+/* Read the block sizes and headers, v2 headers give the offsets of
+ * decompressed blocks */
+static int stream_file_scan(struct stream_file_job *job, off_t src_len)
 {
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    struct stream_file_block *new_blocks;
+    struct ulz77_header header;
+    unsigned char header_buf[ULZ77_HEADER_SIZE_MAX], size_buf[sizeof(uint32_t)];
+    size_t capacity = 0;
+    uint32_t block_size;
+    off_t src_offset = 0, dst_offset = 0;
+    int ret;
 
-    ulz77_stream_set_reader_null(stream);
-    stream->reader_type = ULZ77_STREAM_WRITER_TYPE_CB;
-    stream->reader_cb = reader_cb;
+    while (src_offset != src_len)
+    {
+        if ((ret = pread_full(job->fd_src, size_buf, sizeof(uint32_t), src_offset)) != 0) return ret;
+        block_size = read_le32(size_buf);
+        src_offset += sizeof(uint32_t);
+        if ((off_t)block_size > src_len - src_offset) return -ULZ77_ERR_FILE_READ;
+
+        if (job->block_count == capacity)
+        {
+            capacity = MAX(capacity * 2, 64);
+            new_blocks = (struct stream_file_block *)mem_realloc(job->blocks, sizeof(struct stream_file_block) * capacity);
+            if (new_blocks == NULL) return -ULZ77_ERR_MALLOC;
+            job->blocks = new_blocks;
+        }
+
+        ret = pread_full(job->fd_src, header_buf, MIN(block_size, ULZ77_HEADER_SIZE_MAX), src_offset);
+        if (ret != 0) return ret;
+        if (is_index_block(header_buf, MIN(block_size, ULZ77_HEADER_SIZE_MAX)))
+        {
+            /* index of seekable stream */
+            src_offset += block_size;
+            continue;
+        }
+        if ((ret = parse_header(header_buf, MIN(block_size, ULZ77_HEADER_SIZE_MAX), &header)) != 0) return ret;
+        if (header.format == ULZ77_FORMAT_V1) job->unsized = 1;
+        if ((header.format == ULZ77_FORMAT_V1) || ((header.flags & ULZ77_FLAG_LINKED) != 0)) job->ordered = 1;
+        if (header.content_size > (uint64_t)SIZE_MAX / 2 - (uint64_t)dst_offset) return -ULZ77_ERR_INVALID_DATA;
+
+        job->blocks[job->block_count].src_offset = src_offset;
+        job->blocks[job->block_count].src_len = block_size;
+        job->blocks[job->block_count].dst_offset = dst_offset;
+        job->blocks[job->block_count].dst_len = header.content_size;
+        job->block_count++;
+        src_offset += block_size;
+        dst_offset += (off_t)header.content_size;
+    }
+    job->dst_len = (size_t)dst_offset;
 
     return 0;
 }
 
-/* Push data into stream */
-int ulz77_stream_push(struct ulz77_stream *stream, unsigned char *data, size_t size)
+#endif
+
+/* Read decompressed data at offset of seekable stream */
+int ulz77_stream_read_at(struct ulz77_stream *stream, uint64_t offset, unsigned char *data, size_t len, size_t *read_len)
 {
-    int ret = 0;
-    unsigned char *dst = NULL;
-    size_t dst_len = 0;
-    size_t written_len;
+    struct ulz77_stream_index *index;
+    size_t lo, hi, mid, copy_len;
+    uint64_t block_offset;
+    int ret;
 
-    if (stream == NULL) return -ULZ77_ERR_NULL_PTR;
+    if ((stream == NULL) || (read_len == NULL) || ((data == NULL) && (len != 0))) return -ULZ77_ERR_NULL_PTR;
+    *read_len = 0;
 
-    /* Compress data */
-    ret = ulz77_encode_data(&dst, &dst_len, data, size, ULZ77_TYPE_COMPRESSION);
-    if (ret != 0)
+    if (stream->read_index == NULL)
     {
-        goto done;
+        if ((ret = stream_load_index(stream)) != 0) return ret;
     }
+    index = stream->read_index;
+    if ((index->count == 0) || (offset >= index->dst_offsets[index->count])) return 0;
 
-    /* Process the data */
-    switch (stream->writer_type)
+    /* the last block starting at or before offset */
+    lo = 0;
+    hi = index->count - 1;
+    while (lo < hi)
     {
-        case ULZ77_STREAM_READER_TYPE_NULL:
-            /* Do nothing */
-            break;
-        case ULZ77_STREAM_WRITER_TYPE_CB:
-            /* Write size of compressed data */
-            ret = (*stream->writer_cb)((unsigned char *)&dst_len, sizeof(uint32_t));
-            if (ret != 0) goto done;
-            /* Write compressed data */
-            ret = (*stream->writer_cb)(dst, dst_len);
-            if (ret != 0) goto done;
-            break;
-        case ULZ77_STREAM_WRITER_TYPE_FP:
-            /* Write size of compressed data */
-            written_len = fwrite((unsigned char *)&dst_len, sizeof(uint32_t), 1, stream->writer_fp);
-            if (written_len < 1)
-            { ret = ULZ77_ERR_FILE_WRITE; goto done; }
-            /* Write compressed data */
-            written_len = fwrite(dst, dst_len, 1, stream->writer_fp);
-            if (written_len < 1)
-            { ret = ULZ77_ERR_FILE_WRITE; goto done; }
-            break;
-        default:
-            ret = -ULZ77_ERR_UNKNOWN_WRITER;
-            break;
+        mid = lo + (hi - lo + 1) / 2;
+        if (index->dst_offsets[mid] <= offset) lo = mid; else hi = mid - 1;
     }
 
-done:
-    if (dst != NULL) free(dst);
-    return ret;
+    while ((*read_len < len) && (lo < index->count))
+    {
+        if ((ret = stream_read_block(stream, lo)) != 0) return ret;
+        block_offset = offset + *read_len - index->dst_offsets[lo];
+        copy_len = (size_t)MIN((uint64_t)(len - *read_len), index->dst_offsets[lo + 1] - index->dst_offsets[lo] - block_offset);
+        memcpy(data + *read_len, index->block + block_offset, copy_len);
+        *read_len += copy_len;
+        lo++;
+    }
+
+    return 0;
 }
 
-/* Pull data from stream */
-int ulz77_stream_pull(struct ulz77_stream *stream, unsigned char **data, size_t *size)
+/* Decompress file of stream blocks with specified number of threads */
+int ulz77_decompress_stream_file(const char *filename_dst, const char *filename_src, int threads)
+{
+    return ulz77_decompress_stream_file_dict(filename_dst, filename_src, NULL, threads);
+}
+
+/* Decompress file of stream blocks compressed with dictionary with specified number of threads */
+int ulz77_decompress_stream_file_dict(const char *filename_dst, const char *filename_src,
+        const struct ulz77_dict *dict, int threads)
 {
+#ifdef ULZ77_THREADS
+    struct stream_file_job job;
+    struct stat st;
+    pthread_t *workers = NULL;
+    int worker_count = 0, i;
     int ret = 0;
-    uint32_t block_size;
-    unsigned char *src = NULL;
-    unsigned char *dst = NULL;
-    size_t dst_len;
 
-    switch (stream->reader_type)
+    if ((filename_dst == NULL) || (filename_src == NULL)) return -ULZ77_ERR_NULL_PTR;
+    if (threads < 1) return -ULZ77_ERR_INVALID_ARGS;
+
+    job.fd_src = job.fd_dst = -1;
+    job.dict = dict;
+    job.dst = NULL;
+    job.dst_len = 0;
+    job.blocks = NULL;
+    job.block_count = 0;
+    job.next = 0;
+    job.ordered = 0;
+    job.unsized = 0;
+    job.ret = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    job.fd_src = open(filename_src, O_RDONLY);
+    if ((job.fd_src < 0) || (fstat(job.fd_src, &st) != 0))
     {
-        case ULZ77_STREAM_READER_TYPE_NULL:
-            ret = -ULZ77_ERR_INVALID_READER;
-            goto fail;
-            break;
-        case ULZ77_STREAM_READER_TYPE_FP:
-            /* Read block size */
-            if (fread(&block_size, sizeof(uint32_t), 1, stream->reader_fp) < 1)
-            {
-                ret = -ULZ77_ERR_FILE_READ;
-                goto fail;
-            }
-            /* Allocate space for block */
-            src = (unsigned char *)malloc(sizeof(unsigned char) * block_size);
-            if (src == NULL)
-            {
-                ret = -ULZ77_ERR_MALLOC;
-                goto fail;
-            }
-            /* Read block */
-            if (fread(src, block_size, 1, stream->reader_fp) < 1)
-            {
-                ret = -ULZ77_ERR_FILE_READ;
-                goto fail;
-            }
-            break;
-        case ULZ77_STREAM_READER_TYPE_CB:
-            ret = -ULZ77_ERR_UNKNOWN_READER;
-            goto fail;
-            break;
-        default:
-            ret = -ULZ77_ERR_UNKNOWN_READER;
-            goto fail;
-            break;
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto done;
+    }
+    job.fd_dst = open(filename_dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (job.fd_dst < 0)
+    {
+        ret = -ULZ77_ERR_FILE_OPEN;
+        goto done;
     }
 
-    ret = ulz77_encode_data(&dst, &dst_len, src, block_size, ULZ77_TYPE_DECOMPRESSION);
-    if (ret != 0)
+    if ((ret = stream_file_scan(&job, st.st_size)) != 0) goto done;
+    if (job.unsized == 0)
     {
-        goto fail;
+        /* blocks are decoded directly into their offsets of destination */
+        if ((ftruncate(job.fd_dst, (off_t)job.dst_len) != 0) || \
+                ((job.dst = map_file(job.fd_dst, job.dst_len, PROT_READ | PROT_WRITE)) == NULL))
+        {
+            ret = -ULZ77_ERR_FILE_WRITE;
+            goto done;
+        }
     }
-    stream->reader_count = block_size + 4; /* 4 is the size of block size */
-    stream->reader_total_count += block_size;
-    *data = dst;
-    *size = dst_len;
-    ret = 0;
-    goto done;
-fail:
-    if (dst != NULL) free(dst);
+    if (job.ordered != 0) threads = 1;
+    threads = (int)MIN((size_t)threads, MAX(job.block_count, 1));
+
+    workers = (pthread_t *)mem_alloc(sizeof(pthread_t) * (size_t)threads);
+    if (workers == NULL)
+    {
+        ret = -ULZ77_ERR_MALLOC;
+        goto done;
+    }
+    while (worker_count < threads)
+    {
+        if (pthread_create(&workers[worker_count], NULL, stream_file_worker, &job) != 0) break;
+        worker_count++;
+    }
+    /* the started workers still take every block */
+    for (i = 0; i < worker_count; i++) pthread_join(workers[i], NULL);
+    ret = (worker_count == 0) ? -ULZ77_ERR_THREAD : job.ret;
+
 done:
-    if (src != NULL) free(src);
+    if (workers != NULL) mem_free(workers);
+    unmap_file(job.dst, job.dst_len);
+    if (job.blocks != NULL) mem_free(job.blocks);
+    if (job.fd_src >= 0) close(job.fd_src);
+    if ((job.fd_dst >= 0) && (close(job.fd_dst) != 0) && (ret == 0)) ret = -ULZ77_ERR_FILE_WRITE;
+    pthread_mutex_destroy(&job.lock);
     return ret;
+#else
+    (void)filename_dst;
+    (void)filename_src;
+    (void)dict;
+    (void)threads;
+    return -ULZ77_ERR_THREAD;
+#endif
 }
 
 /* Copy Error description */
@@ -1142,26 +4940,32 @@ int ulz77_error_description_cpy(char *buf, size_t buf_len, int err_no)
 {
     static const char *err_msg[] =
     {
+        "Undefined error",
         "Unknown error",
         "Null Pointer",
         "Invalid argument",
         "Memory allocation failed",
         "File opening failed",
         "File reading failed",
+        "File writing failed",
         "Buffer full",
         "Undefined operation",
-        "Unknown reader",
-        "Invalid reader",
-        "Unknown writter",
         "Invalid writter",
+        "Unknown writter",
+        "Invalid reader",
+        "Unknown reader",
         "Narrow buffer size",
-        "Undefined error",
+        "Invalid data",
+        "Thread creation failed",
+        "Dictionary mismatch",
     };
 
+    if (buf_len == 0) return 0;
     if ((err_no >= 0)||((unsigned int)(-err_no)>=sizeof(err_msg)/sizeof(char*))) 
-    { return 0; }
+    { err_no = 0; }
 
-    strncpy(buf, err_msg[err_no], buf_len);
+    strncpy(buf, err_msg[-err_no], buf_len - 1);
+    buf[buf_len - 1] = '\0';
 
     return 0;
 }
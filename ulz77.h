@@ -22,6 +22,7 @@
 #define _ULZ77_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 /*******************
  *  Return Values  *
@@ -43,67 +44,164 @@ enum
     ULZ77_ERR_INVALID_READER = 12,
     ULZ77_ERR_UNKNOWN_READER = 13,
     ULZ77_ERR_NARROW_BUFFER_SIZE = 14,
+    ULZ77_ERR_INVALID_DATA = 15,
+    ULZ77_ERR_THREAD = 16,
+    ULZ77_ERR_DICT = 17,
 };
 
 /* Buffer */
-#define ULZ77_BUFFER_RESERVED_SIZE 10 /* 10 Bytes = Last 3 Sentinels's length at worst situation */
+#define ULZ77_BUFFER_RESERVED_SIZE 10 /* 10 Bytes = the longest match token */
+#define ULZ77_HEADER_SIZE_MAX 21 /* magic, version, window, flags, 10 bytes of content size and dictionary ID */
+
+/* Format */
+#define ULZ77_FORMAT_V1 (1) /* headerless, 4096 bytes window, decoding only */
+#define ULZ77_FORMAT_V2 (2)
+
+/* Flags of format v2 */
+#define ULZ77_FLAG_SEQUENCE (0x01) /* literal runs and matches in sequences, nothing escaped */
+#define ULZ77_FLAG_ENTROPY (0x02) /* sequences split into streams and Huffman coded, implies ULZ77_FLAG_SEQUENCE */
+#define ULZ77_FLAG_LINKED (0x04) /* block may refer to the window of the previous linked block */
+#define ULZ77_FLAG_DICT (0x08) /* block may refer to the preset dictionary of ID in header, set by encoder */
+
+/* Window */
+#define ULZ77_WINDOW_LOG_MIN (12) /* 4 KB */
+#define ULZ77_WINDOW_LOG_MAX (24) /* 16 MB */
+#define ULZ77_WINDOW_LOG_DEFAULT (16) /* 64 KB */
+
+/* Dictionary */
+#define ULZ77_DICT_SIZE_MAX (1 << ULZ77_WINDOW_LOG_MAX) /* bytes farther than the largest window are dropped */
 
 /* Hash */
-#define ULZ77_HASH_LITERAL_SIZE (3) /* length of literal used to compute hash (bytes) */
+#define ULZ77_HASH_LITERAL_SIZE (4) /* length of literal used to compute hash (bytes) */
 #define ULZ77_HASH_SIZE_BIT (17) /* hash size (bit) */
 #define ULZ77_HASH_SIZE (1<<(ULZ77_HASH_SIZE_BIT)) /* hash size (bit) */
 #define ULZ77_HASH_MASK ((1<<(ULZ77_HASH_SIZE_BIT))-1) /* hash size (bit) */
-/* Compute hash */
-#define ULZ77_HASH(x) ((x)&ULZ77_HASH_MASK)
+/* Compute hash of the 4 bytes literal (Knuth's multiplicative method) */
+#define ULZ77_HASH(x) ((((uint32_t)(x))*2654435761U)>>(32-(ULZ77_HASH_SIZE_BIT)))
 
-/* Match Chain */
-#define ULZ77_RECENT_POS_SIZE (ULZ77_HASH_LITERAL_SIZE + ULZ77_MATCH_CHAIN_SIZE)
-#define ULZ77_MATCH_CHAIN_SIZE (10)
-/*#define USE_MATCH_CHAIN (0)*/
+/* Compression Level */
+#define ULZ77_LEVEL_MIN (0) /* no searching, literals only */
+#define ULZ77_LEVEL_MAX (10) /* optimal parsing */
+#define ULZ77_LEVEL_DEFAULT (6)
 
 
 /************************************************
  *  Data Structures of Buffer Ring and Encoder  *
  ************************************************/
 
-struct buffer_ring
+/* Preset dictionary, read-only once created */
+struct ulz77_dict;
+
+/* Allocator of library, for every allocation including the buffers given
+ * to caller, the default one is malloc(), realloc() and free() */
+struct ulz77_allocator
 {
-	unsigned char *buf; /* ring body */
+    void *(*alloc_fn)(void *opaque, size_t size);
+    void *(*realloc_fn)(void *opaque, void *ptr, size_t size);
+    void (*free_fn)(void *opaque, void *ptr);
+    void *opaque;
+};
+
+/* Parameters of encoder */
+struct ulz77_params
+{
+    int level; /* compression level */
+    unsigned int window_log; /* window size is (1 << window_log) bytes */
+    unsigned int flags; /* ULZ77_FLAG_* of the format */
+    const struct ulz77_dict *dict; /* preset dictionary, NULL for none */
+};
 
-    /* old <-- recent_pos[2], recent_pos[1], recent_pos_[0], pos --> new */
-	unsigned int recent_pos[ULZ77_RECENT_POS_SIZE]; /* position in the ring when added */
-	unsigned int pos; /* current position in the ring */
+/* Parameters of a compression level */
+struct ulz77_level
+{
+    unsigned int max_chain; /* candidates visited per position at most, 0 for no searching */
+    unsigned int good_len; /* stop searching once a match is this long, 0 for no limit */
+    unsigned int lazy; /* bytes to look ahead for a longer match, 0 for greedy matching */
+    unsigned int optimal; /* choose the cheapest tokens among all the matches */
+};
+
+/* Node of optimal parsing, the cheapest step found to reach a position */
+struct ulz77_opt_node
+{
+    uint32_t price; /* bytes of output to reach the position */
+    uint32_t len; /* length of the step, 1 for a literal */
+    uint32_t distance; /* distance of the step, 0 for a literal */
+};
+
+struct buffer_ring
+{
+	unsigned char *buf; /* ring body, mirrored: buf[i] == buf[i + size] */
 
 	unsigned int grow; /* size of growing ring */
-	unsigned int size; /* ring size */
-	int second_pass; /* is the ring buffer grown to the top size? */
+	unsigned int size; /* ring size (power of 2) */
 
-    unsigned int absolute_pos; /* compressed data length */
+    /* absolute position of the next symbol, starts from ring size so that
+     * the zeroed tables are all out of the window */
+    uint32_t absolute_pos;
 
-	/* linked list part : 4 tables for fast pattern-matching */
+	/* match finder : hash head and position-indexed chain */
 
-    /* CAUTION: first and final table store ABSOLUTE POSITION */
-    /* after hash applied, first and final table should able to contain hash size (1 << HASH_SIZE_BIT) of data */
-	int *first_table; /* point to the slot in offset table which stores the first position appeared in ring */
-	int *final_table; /* point to the slot in offset table which stores the final position appeared in ring */
+    /* CAUTION: head and chain table store ABSOLUTE POSITION,
+     * entries farther than the ring size are stale and never followed */
+	uint32_t *head_table; /* the newest position of each hash value */
+	uint32_t *chain_table; /* previous position of the same hash value, indexed by position & (size - 1) */
 
-	int *hash_jump_next_table; /* next position of the same hash result as the one in current pos in jump table */
-	int *hash_jump_prev_table; /* prev position of the same hash result as the one in current pos in jump table */
-#if defined(USE_MATCH_CHAIN)
-    int *match_jump_next_table[ULZ77_MATCH_CHAIN_SIZE]; /* next position of the same match result as the one in current pos in jump table */
-    int *match_jump_prev_table[ULZ77_MATCH_CHAIN_SIZE]; /* next position of the same match result as the one in current pos in jump table */
-#endif
+    /* searched after the ring, its bytes come right before the oldest
+     * byte of ring, NULL for none */
+    const struct ulz77_dict *dict;
+};
 
-	int *offset_table; /* offset of specified jump table slot */
+/* Decoder, keeps nothing but the recent output as the window */
+struct ulz77_decoder
+{
+    unsigned char *window; /* the last output of previous turns */
+    unsigned int window_len; /* bytes in window */
+    unsigned int window_size; /* window size of data being decoded */
+    unsigned int window_capacity; /* bytes allocated for window */
+
+    int format; /* format of data being decoded */
+    unsigned int head_remain; /* raw bytes remain at the beginning of data (v1) */
+    uint64_t content_size; /* size of the decoded data (v2) */
+    uint64_t block_len; /* bytes decoded of the data (v2) */
+    unsigned int flags; /* ULZ77_FLAG_* of the data (v2) */
+    const struct ulz77_dict *dict; /* preset dictionary, NULL for none */
+    unsigned int dict_len; /* bytes of dictionary before the data being decoded */
+    int keep_window; /* keep the window after a block for the next linked one */
+    int is_static; /* buffers are in the workspace of caller, never grown or freed */
+
+    /* sequence interrupted (v2 sequence) */
+    int sequence_stage; /* at the token, the literals or the match */
+    unsigned int match_bits; /* matched length bits of the token */
+    uint64_t literal_remain; /* literals not copied yet */
+    size_t match_remain; /* bytes of match not copied yet, dst was full */
+    size_t match_distance;
+
+    /* sequences decoded from streams (v2 entropy) */
+    unsigned char *entropy_buf;
+    size_t entropy_capacity;
+    unsigned char *entropy_p; /* the next sequence */
+    unsigned char *entropy_endp;
+
+    unsigned char *src_p_interrupted; /* keep last position when interrupted */
+
+    size_t src_len; /* number of input data of one turn */
+    size_t dst_len; /* number of output data of one turn */
+    size_t src_total_len; /* number of input data of total */
+    size_t dst_total_len; /* number of output data of total */
 };
 
 /* Encoder used both in Compression and Decompression */
 struct ulz77_encoder
 {
     struct buffer_ring br;
-
-    unsigned int future_bytes;
-    unsigned int last_bytes;
+    struct ulz77_level level; /* match searching parameters */
+    unsigned int window_log; /* window size is (1 << window_log) bytes */
+    unsigned int flags; /* ULZ77_FLAG_* of the format */
+    struct ulz77_opt_node *opt; /* nodes of optimal parsing, NULL unless the level needs */
+    struct ulz77_decoder *dec; /* created when decoding with an encoder */
+    unsigned char *entropy_buf; /* sequences and streams of entropy coded block */
+    size_t entropy_capacity;
+    int is_static; /* tables and buffers are in the workspace of caller */
 
     unsigned char *src_p_interrupted; /* keep last position when interrupted */
 
@@ -118,47 +216,194 @@ struct ulz77_encoder
  *  Low-Level Interface  *
  *************************/
 
+/* Set allocator of library before anything is allocated, NULL for the
+ * default one */
+int ulz77_set_allocator(const struct ulz77_allocator *allocator);
+
 /* Create new encoder */
 struct ulz77_encoder *ulz77_encoder_new(void);
 
+/* Create new encoder with specified compression level */
+struct ulz77_encoder *ulz77_encoder_new_level(int level);
+
+/* Initialize encoder parameters with default values */
+int ulz77_params_init(struct ulz77_params *params);
+
+/* Create new encoder with specified parameters */
+struct ulz77_encoder *ulz77_encoder_new_params(const struct ulz77_params *params);
+
+/* Bytes of workspace for a static encoder of params, 0 if params are invalid,
+ * entropy coded blocks up to the window size fit, larger ones need more */
+size_t ulz77_workspace_size(const struct ulz77_params *params);
+
+/* Bytes of workspace for a static encoder of entropy coded blocks up to
+ * max_len bytes (at least the window size), which takes the sequences
+ * and the streams of a block, 4 times their bound of 2 * max_len + 64 */
+size_t ulz77_workspace_size_block(const struct ulz77_params *params, size_t max_len);
+
+/* Initialize encoder in workspace mem of len bytes, which allocates nothing
+ * then, the workspace is aligned to cache lines inside */
+struct ulz77_encoder *ulz77_encoder_init_static(void *mem, size_t len, const struct ulz77_params *params);
+
 /* Destroy encoder */
 int ulz77_encoder_destroy(struct ulz77_encoder *enc);
 
+/* Create a preset dictionary, it is hashed once and read-only, so any
+ * number of encoders and decoders on any threads could share it */
+struct ulz77_dict *ulz77_dict_create(const unsigned char *buf, size_t len);
+
+/* Destroy dictionary, after all the encoders and decoders using it */
+int ulz77_dict_destroy(struct ulz77_dict *dict);
+
+/* Get ID of dictionary, which is recorded in header of the data using it */
+uint32_t ulz77_dict_id(const struct ulz77_dict *dict);
+
+/* Train dictionary of at most dict_cap bytes from sample_count samples,
+ * which are concatenated in samples with their sizes in sample_sizes */
+int ulz77_dict_train(unsigned char *dict, size_t dict_cap, size_t *dict_len, const unsigned char *samples, const size_t *sample_sizes, size_t sample_count);
+
+/* Reset encoder for independent data, which costs no clearing of tables */
+int ulz77_encoder_reset(struct ulz77_encoder *enc);
+
 /* Encode data */
 int ulz77_encoder_encode(struct ulz77_encoder *enc, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len);
 
-/* Decode data */
+/* Decode data (kept for compatibility, decodes through ulz77_decoder) */
 int ulz77_encoder_decode(struct ulz77_encoder *enc, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len);
 
 /* Get Previous position of src */
 unsigned char *ulz77_encoder_get_previous(struct ulz77_encoder *enc);
 
+/* Create new decoder */
+struct ulz77_decoder *ulz77_decoder_new(void);
+
+/* Bytes of workspace for a static decoder of data compressed with params */
+size_t ulz77_decoder_workspace_size(const struct ulz77_params *params);
+
+/* Bytes of workspace for a static decoder of entropy coded blocks up to
+ * max_len bytes (at least the window size) */
+size_t ulz77_decoder_workspace_size_block(const struct ulz77_params *params, size_t max_len);
+
+/* Initialize decoder in workspace mem of len bytes, which allocates nothing */
+struct ulz77_decoder *ulz77_decoder_init_static(void *mem, size_t len, const struct ulz77_params *params);
+
+/* Destroy decoder */
+int ulz77_decoder_destroy(struct ulz77_decoder *dec);
+
+/* Set dictionary of decoder for data compressed with it, NULL for none */
+int ulz77_decoder_set_dict(struct ulz77_decoder *dec, const struct ulz77_dict *dict);
+
+/* Reset decoder for independent data, buffers are kept */
+int ulz77_decoder_reset(struct ulz77_decoder *dec);
+
+/* Decode data */
+int ulz77_decoder_decode(struct ulz77_decoder *dec, unsigned char *dst, size_t dst_buffer_size, unsigned char *src, size_t len);
+
+/* Get Previous position of src */
+unsigned char *ulz77_decoder_get_previous(struct ulz77_decoder *dec);
+
 /**************************
  *  High-Level Interface  *
  **************************/
 
+/* Worst case of compressed size of len bytes with any parameters,
+ * 0 if len is too large */
+size_t ulz77_compress_bound(size_t len);
+
+/* Compress data into dst of dst_cap bytes, ulz77_compress_bound() bytes
+ * always fit, params could be NULL for the default ones */
+int ulz77_compress_into(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len, const struct ulz77_params *params);
+
+/* Get decompressed size of data from its header, v1 has no header */
+int ulz77_content_size(const unsigned char *src, size_t src_len, uint64_t *content_size);
+
+/* Decompress data into dst of dst_cap bytes */
+int ulz77_decompress_into(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len);
+
+/* Decompress data compressed with dictionary into dst of dst_cap bytes */
+int ulz77_decompress_into_dict(unsigned char *dst, size_t dst_cap, size_t *dst_len, unsigned char *src, size_t src_len, const struct ulz77_dict *dict);
+
 /* Compress data */
 int ulz77_compress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len);
 
+/* Compress data with specified compression level */
+int ulz77_compress_data_level(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, int level);
+
+/* Compress data with specified parameters */
+int ulz77_compress_data_params(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len, const struct ulz77_params *params);
+
 /* Decompress data */
 int ulz77_decompress_data(unsigned char **dst_out, size_t *dst_out_len, unsigned char *src, size_t src_len);
 
 /* Compress file */
 int ulz77_compress_file(const char *filename_dst, const char *filename_src);
 
+/* Compress file with specified compression level */
+int ulz77_compress_file_level(const char *filename_dst, const char *filename_src, int level);
+
+/* Compress file with specified parameters */
+int ulz77_compress_file_params(const char *filename_dst, const char *filename_src, const struct ulz77_params *params);
+
 /* Decompress file */
 int ulz77_decompress_file(const char *filename_dst, const char *filename_src);
 
+/* Decompress file compressed with dictionary */
+int ulz77_decompress_file_dict(const char *filename_dst, const char *filename_src, const struct ulz77_dict *dict);
+
+/* Compress file through memory mapping, without copies of the whole file */
+int ulz77_compress_file_mmap(const char *filename_dst, const char *filename_src, const struct ulz77_params *params);
+
+/* Decompress file through memory mapping, without copies of the whole file */
+int ulz77_decompress_file_mmap(const char *filename_dst, const char *filename_src);
+
+/* Decompress file compressed with dictionary through memory mapping */
+int ulz77_decompress_file_mmap_dict(const char *filename_dst, const char *filename_src, const struct ulz77_dict *dict);
+
+/* Decompress file of stream blocks with specified number of threads,
+ * blocks are decoded concurrently into their offsets of destination */
+int ulz77_decompress_stream_file(const char *filename_dst, const char *filename_src, int threads);
+
+/* Decompress file of stream blocks compressed with dictionary with specified number of threads */
+int ulz77_decompress_stream_file_dict(const char *filename_dst, const char *filename_src,
+        const struct ulz77_dict *dict, int threads);
+
 /**********************
  *  Stream Interface  *
  **********************/
 
+struct ulz77_stream_pool;
+struct ulz77_stream_index;
+struct ulz77_stream_context;
+
+/* A piece of a batch given to the vectored writer */
+struct ulz77_iovec
+{
+    const unsigned char *data;
+    size_t size;
+};
+
 struct ulz77_stream
 {
+    struct ulz77_params params; /* parameters of pushed blocks, with the dictionary of pulled ones */
+
+    /* Workers compressing pushed blocks concurrently, NULL for one thread */
+    struct ulz77_stream_pool *pool;
+
+    /* Encoder, decoder and buffers kept between blocks, created on use */
+    struct ulz77_stream_context *context;
+
+    /* Index of blocks */
+    int seekable; /* index is written when the stream ends */
+    struct ulz77_stream_index *write_index; /* blocks written */
+    struct ulz77_stream_index *read_index; /* loaded from reader, with the last block read */
+
     /* Writer */
     int writer_type;
     FILE *writer_fp;
     int (*writer_cb)(unsigned char *data, size_t size);
+    int (*writer_iov_cb)(void *opaque, const struct ulz77_iovec *iov, int iov_count);
+    void *writer_iov_opaque;
+    int writer_fd;
 
     /* Reader */
     int reader_type;
@@ -174,6 +419,20 @@ struct ulz77_stream *ulz77_stream_new(void);
 /* Destroy a stream */
 int ulz77_stream_destroy(struct ulz77_stream *stream);
 
+/* Set compression level of stream */
+int ulz77_stream_set_level(struct ulz77_stream *stream, int level);
+
+/* Set encoder parameters of stream */
+int ulz77_stream_set_params(struct ulz77_stream *stream, const struct ulz77_params *params);
+
+/* Set dictionary of stream for both pushed and pulled blocks, NULL for none */
+int ulz77_stream_set_dict(struct ulz77_stream *stream, const struct ulz77_dict *dict);
+
+/* Set number of threads compressing pushed blocks, blocks are still
+ * written in the order of pushing, call ulz77_stream_flush() to write
+ * all of them */
+int ulz77_stream_set_threads(struct ulz77_stream *stream, int threads);
+
 
 /* Stream writer Null */
 int ulz77_stream_set_writer_null(struct ulz77_stream *stream);
@@ -184,9 +443,27 @@ int ulz77_stream_set_writer_fp(struct ulz77_stream *stream, FILE *fp);
 /* Stream writer Callback */
 int ulz77_stream_set_writer_callback(struct ulz77_stream *stream, int (*writer_cb)(unsigned char *data, size_t size));
 
+/* Stream writer Vectored callback, a block and its size are given in one
+ * call as a batch of pieces, opaque is passed back to the callback */
+int ulz77_stream_set_writer_iov_callback(struct ulz77_stream *stream, \
+        int (*writer_iov_cb)(void *opaque, const struct ulz77_iovec *iov, int iov_count), void *opaque);
+
+/* Stream writer File Descriptor, a block and its size are written with
+ * one writev(), the descriptor is not closed by stream (POSIX only) */
+int ulz77_stream_set_writer_fd(struct ulz77_stream *stream, int fd);
+
 /* Push data into stream */
 int ulz77_stream_push(struct ulz77_stream *stream, unsigned char *data, size_t size);
 
+/* Write all the blocks pushed into stream */
+int ulz77_stream_flush(struct ulz77_stream *stream);
+
+/* Record blocks written into the index, which is written at the end */
+int ulz77_stream_set_seekable(struct ulz77_stream *stream, int seekable);
+
+/* End stream, write all the blocks and the index of a seekable stream */
+int ulz77_stream_end(struct ulz77_stream *stream);
+
 /* Stream reader Null */
 int ulz77_stream_set_reader_null(struct ulz77_stream *stream);
 
@@ -196,9 +473,31 @@ int ulz77_stream_set_reader_fp(struct ulz77_stream *stream, FILE *fp);
 /* Stream reader Callback */
 int ulz77_stream_set_reader_callback(struct ulz77_stream *stream, int (*readr_cb)(unsigned char *data, size_t size));
 
-/* Pull data from stream */
+/* Pull data from stream, index of seekable stream gives no data */
 int ulz77_stream_pull(struct ulz77_stream *stream, unsigned char **data, size_t *size);
 
+/* Pull data from stream into dst, return -ULZ77_ERR_BUFFER_FULL with the
+ * size of block in *size if it is larger than dst_cap, then the same
+ * block is pulled again */
+int ulz77_stream_pull_into(struct ulz77_stream *stream, unsigned char *dst, size_t dst_cap, size_t *size);
+
+/* Pull data from stream into a buffer of stream, which is kept till the
+ * next pull */
+int ulz77_stream_pull_view(struct ulz77_stream *stream, const unsigned char **data, size_t *size);
+
+/* Decode stream from compressed input pushed in pieces of any size, as it
+ * comes from a socket. *src_used bytes of src are taken and *dst_len bytes
+ * are written into dst, return -ULZ77_ERR_BUFFER_FULL if dst is full
+ * before src is all decoded, then push the rest of src again */
+int ulz77_stream_feed(struct ulz77_stream *stream, unsigned char *dst, size_t dst_cap, size_t *dst_len, const unsigned char *src, size_t src_len, size_t *src_used);
+
+/* End input pushed, return -ULZ77_ERR_INVALID_DATA if it stops in a block */
+int ulz77_stream_feed_end(struct ulz77_stream *stream);
+
+/* Read decompressed data at offset of seekable stream from the reader
+ * file pointer, only the blocks covering the range are decoded */
+int ulz77_stream_read_at(struct ulz77_stream *stream, uint64_t offset, unsigned char *data, size_t len, size_t *read_len);
+
 /***********
  *  Error  *
  ***********/